@@ -276,25 +276,30 @@ int F01::rmi_f01_config()
 
 int F01::rmi_f01_read_properties()
 {
-    u8 queries[RMI_F01_BASIC_QUERY_LEN];
+    u8 queries[RMI_F01_QUERY_SPAN];
     int ret;
-    int query_offset = fn_descriptor->query_base_addr;
+    int query_offset = 0;
     bool has_ds4_queries = false;
     bool has_query42 = false;
     bool has_sensor_id = false;
     bool has_package_id_query = false;
     bool has_build_id_query = false;
-    u16 prod_info_addr;
+    u16 prod_info_offset;
     u8 ds4_query_len;
+    UInt32 transactions = rmiBus->transactions;
     
-    ret = rmiBus->readBlock(query_offset,
-                         queries, RMI_F01_BASIC_QUERY_LEN);
+    /*
+     * The optional queries and the product info all sit within a few
+     * bytes past the basic queries, so read them in one go
+     */
+    ret = rmiBus->readBlock(fn_descriptor->query_base_addr,
+                            queries, RMI_F01_QUERY_SPAN);
     if (ret) {
         IOLogError("F01 failed to read device query registers: %d\n", ret);
         return ret;
     }
     
-    prod_info_addr = query_offset + 17;
+    prod_info_offset = 17;
     query_offset += RMI_F01_BASIC_QUERY_LEN;
     
     /* Now parse what we got */
@@ -326,64 +331,34 @@ int F01::rmi_f01_read_properties()
         query_offset++;
     
     if (has_query42) {
-        ret = rmiBus->read(query_offset, queries);
-        if (ret) {
-            IOLogError("Failed to read query 42 register: %d\n", ret);
-            return ret;
-        }
-        
-        has_ds4_queries = !!(queries[0] & BIT(0));
+        has_ds4_queries = !!(queries[query_offset] & BIT(0));
         query_offset++;
     }
     
     if (has_ds4_queries) {
-        ret = rmiBus->read(query_offset, &ds4_query_len);
-        if (ret) {
-            IOLogError("Failed to read DS4 queries length: %d\n", ret);
-            return ret;
-        }
+        ds4_query_len = queries[query_offset];
         query_offset++;
         
         if (ds4_query_len > 0) {
-            ret = rmiBus->read(query_offset, queries);
-            if (ret) {
-                IOLogError("Failed to read DS4 queries: %d\n",
-                        ret);
-                return ret;
-            }
-            
-            has_package_id_query = !!(queries[0] & BIT(0));
-            has_build_id_query = !!(queries[0] & BIT(1));
+            has_package_id_query = !!(queries[query_offset] & BIT(0));
+            has_build_id_query = !!(queries[query_offset] & BIT(1));
         }
         
         if (has_package_id_query) {
-            ret = rmiBus->readBlock(prod_info_addr,
-                                 queries, sizeof(__le64));
-            if (ret) {
-                IOLogError("Failed to read package info: %d\n",
-                        ret);
-                return ret;
-            }
-            
             // Truncates in F01.c in Linux as well, no clue why.
             // Casting to remove warning
-            properties->package_id = (u32) get_unaligned_le64(queries);
-            prod_info_addr++;
+            properties->package_id = (u32) get_unaligned_le64(&queries[prod_info_offset]);
+            prod_info_offset++;
         }
         
         if (has_build_id_query) {
-            ret = rmiBus->readBlock(prod_info_addr, queries, 3);
-            if (ret) {
-                IOLogError("Failed to read product info: %d\n",
-                        ret);
-                return ret;
-            }
-            
-            properties->firmware_id = queries[1] << 8 | queries[0];
-            properties->firmware_id += queries[2] * 65536;
+            properties->firmware_id = queries[prod_info_offset + 1] << 8 | queries[prod_info_offset];
+            properties->firmware_id += queries[prod_info_offset + 2] * 65536;
         }
     }
     
+    setProperty("Query Transactions", rmiBus->transactions - transactions, 32);
+    
     return 0;
 }
 
@@ -42,6 +42,7 @@
 #define RMI_F01_QRY2_PRODINFO_MASK    0x7f
 
 #define RMI_F01_BASIC_QUERY_LEN        21 /* From Query 00 through 20 */
+#define RMI_F01_QUERY_SPAN             25 /* Up to the first DS4 query */
 
 
 struct f01_basic_properties {
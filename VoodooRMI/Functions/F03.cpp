@@ -26,6 +26,26 @@ bool F03::init(OSDictionary *dictionary)
     trackstickScrollXMult = Configuration::loadUInt32Configuration(dictionary, "TrackstickScrollMultiplierX", DEFAULT_MULT);
     trackstickScrollYMult = Configuration::loadUInt32Configuration(dictionary, "TrackstickScrollMultiplierY", DEFAULT_MULT);
     trackstickDeadzone = Configuration::loadUInt32Configuration(dictionary, "TrackstickDeadzone", 1);
+    scrollMomentum = Configuration::loadBoolConfiguration(dictionary, "TrackstickScrollMomentum", false);
+    tpInertia = Configuration::loadUInt32Configuration(dictionary, "TrackpointInertia", 0);
+    tpPressToSelect = Configuration::loadUInt32Configuration(dictionary, "TrackpointPressToSelect", 0);
+    
+    /*
+     * Let the trackpoint scale movement itself, before it gets quantized into
+     * packets. Its sensitivity register is a multiplier where TP_DEF_SENS is 1.0,
+     * so the multipliers here shrink to whatever the register can't cover.
+     */
+    if (Configuration::loadBoolConfiguration(dictionary, "TrackpointHardwareScaling", false)) {
+        tpSensitivity = min(max(TP_DEF_SENS * trackstickMult / DEFAULT_MULT, 1U), 0xFFU);
+        hwMult = DIV_ROUND_CLOSEST(trackstickMult * TP_DEF_SENS, tpSensitivity);
+        hwScrollXMult = DIV_ROUND_CLOSEST(trackstickScrollXMult * TP_DEF_SENS, tpSensitivity);
+        hwScrollYMult = DIV_ROUND_CLOSEST(trackstickScrollYMult * TP_DEF_SENS, tpSensitivity);
+    }
+    
+    // Only switched over once the trackpoint took the sensitivity
+    cfgMult = trackstickMult;
+    cfgScrollXMult = trackstickScrollXMult;
+    cfgScrollYMult = trackstickScrollYMult;
     
     return true;
 }
@@ -101,6 +121,27 @@ bool F03::start(IOService *provider)
     }
     command_gate->enable();
     
+    ps2_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &F03::ps2TimeoutOccured));
+    if (!ps2_timer || (work_loop->addEventSource(ps2_timer) != kIOReturnSuccess)) {
+        IOLogError("F03 - Could not create PS2 timer\n");
+        OSSafeReleaseNULL(ps2_timer);
+        work_loop->removeEventSource(command_gate);
+        OSSafeReleaseNULL(command_gate);
+        OSSafeReleaseNULL(work_loop);
+        return false;
+    }
+    ps2_timer->enable();
+    
+    if (scrollMomentum) {
+        scroll_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &F03::scrollMomentumTick));
+        if (!scroll_timer || (work_loop->addEventSource(scroll_timer) != kIOReturnSuccess)) {
+            IOLogError("F03 - Could not create scroll timer, no momentum\n");
+            OSSafeReleaseNULL(scroll_timer);
+        } else {
+            scroll_timer->enable();
+        }
+    }
+    
     /*
      * Consume any pending data. Some devices like to spam with
      * 0xaa 0x00 announcement which may confuse us as we try to
@@ -115,21 +156,8 @@ bool F03::start(IOService *provider)
     setProperty("VoodooTrackpointSupported", kOSBooleanTrue);
     registerService();
     
-    u8 param[2] = {0};
-
-    // Sending these are important to make the trackpoint work.
-    // But the responses don't work at all and it's voodoo how it actually works
-    error = ps2Command(param, MAKE_PS2_CMD( 0, 2, TP_READ_ID));
-
-    u8 param1[2] = { TP_POR };
-
-    error = ps2Command(param1, MAKE_PS2_CMD(1, 2, TP_COMMAND));
-//    if (param1[0] != 0xAA || param1[1] != 0x00)
-//        IOLogError("Got [%x, %x], should be [0xAA, 0x00]\n", param1[0], param1[1]);
-
-    error = ps2Command(NULL, PSMOUSE_CMD_ENABLE);
-    
     index = 0;
+    initTrackpoint(false);
     
     IOLog("Start finished");
     return super::start(provider);
@@ -137,6 +165,20 @@ bool F03::start(IOService *provider)
 
 void F03::stop(IOService *provider)
 {
+    if (scroll_timer) {
+        scroll_timer->cancelTimeout();
+        work_loop->removeEventSource(scroll_timer);
+        OSSafeReleaseNULL(scroll_timer);
+    }
+    
+    if (ps2_timer) {
+        ps2_timer->cancelTimeout();
+        work_loop->removeEventSource(ps2_timer);
+        OSSafeReleaseNULL(ps2_timer);
+    }
+    ps2Count = 0;
+    ps2State = PS2_STATE_IDLE;
+    
     if (command_gate) {
         work_loop->removeEventSource(command_gate);
         command_gate->release();
@@ -170,6 +212,10 @@ void F03::handlePacketGated(u8 packet)
     if (!voodooTrackpointInstance)
         return;
     
+    // Any input stops momentum, the velocity is kept until the next scroll starts
+    if (scroll_timer)
+        scroll_timer->cancelTimeout();
+    
     // The highest dx/dy is lowered by subtracting by trackstickDeadzone.
     // This however does allows values below the deadzone value to still be sent, preserving control in the lower end
     
@@ -179,6 +225,13 @@ void F03::handlePacketGated(u8 packet)
     // For middle button, we do not actually tell macOS it's been pressed until it's been released and we didn't scroll
     // We first say that it's been pressed internally - but if we scroll at all, then instead we say we scroll
     if (buttons & 0x04 && !isScrolling) {
+        // Fresh press, nothing from the last scroll carries over
+        if (!middlePressed) {
+            scrollVelX = scrollVelY = 0;
+            scrollAccX = scrollAccY = 0;
+            scrollVelTS = 0;
+        }
+        
         if (dx || dy) {
             isScrolling = true;
             middlePressed = false;
@@ -198,21 +251,23 @@ void F03::handlePacketGated(u8 packet)
             relativeEvent.dy = 0;
             relativeEvent.timestamp = timestamp;
             messageClient(kIOMessageVoodooTrackpointRelativePointer, voodooTrackpointInstance, &relativeEvent, sizeof(RelativePointerEvent));
-        } else {
+        } else if (isScrolling) {
+            // Take what this attention scrolled into the velocity first
+            flushScroll(false);
             isScrolling = false;
+            startScrollMomentum(timestamp);
         }
     } else {
         buttons &= ~0x04;
     }
     
     // Must multiply first then divide so we don't multiply by zero
+    // Scrolling is only accumulated here, it's sent once the whole attention is handled
     if (isScrolling) {
-        scrollEvent.deltaAxis1 = (SInt32)((SInt64)-dy * trackstickScrollYMult / DEFAULT_MULT);
-        scrollEvent.deltaAxis2 = (SInt32)((SInt64)-dx * trackstickScrollXMult / DEFAULT_MULT);
-        scrollEvent.deltaAxis3 = 0;
-        scrollEvent.timestamp = timestamp;
-        
-        messageClient(kIOMessageVoodooTrackpointScrollWheel, voodooTrackpointInstance, &scrollEvent, sizeof(ScrollWheelEvent));
+        scrollAccY += (rmi_fixed)((SInt64)-dy * trackstickScrollYMult * RMI_FIXED_ONE / DEFAULT_MULT);
+        scrollAccX += (rmi_fixed)((SInt64)-dx * trackstickScrollXMult * RMI_FIXED_ONE / DEFAULT_MULT);
+        if (dx || dy)
+            lastScrollTS = timestamp;
     } else {
         relativeEvent.buttons = buttons;
         relativeEvent.dx = (SInt32)((SInt64)dx * trackstickMult / DEFAULT_MULT);
@@ -235,78 +290,26 @@ IOReturn F03::message(UInt32 type, IOService *provider, void *argument)
     switch (type) {
         case kHandleRMIAttention: {
             const u16 data_addr = fn_descriptor->data_base_addr + RMI_F03_OB_OFFSET;
-            const u8 ob_len = rx_queue_length * RMI_F03_OB_SIZE;
+            u8 ob_len = rx_queue_length * RMI_F03_OB_SIZE;
             u8 obs[RMI_F03_QUEUE_LENGTH * RMI_F03_OB_SIZE];
             
+            if (!command_gate)
+                break;
+            
             int error = rmiBus->readBlock(data_addr, obs, ob_len);
             if (error) {
                 IOLogError("F03 - Failed to read output buffers: %d\n", error);
                 return kIOReturnError;
             }
             
-            for (int i = 0; i < ob_len; i += RMI_F03_OB_SIZE) {
-                u8 ob_status = obs[i];
-                u8 ob_data = obs[i + RMI_F03_OB_DATA_OFFSET];
-                
-                if (!(ob_status & RMI_F03_RX_DATA_OFB))
-                    continue;
-                
-                if (ob_status & RMI_F03_OB_FLAG_TIMEOUT) {
-                    IOLogDebug("F03 Timeout Flag");
-                    return kIOReturnSuccess;
-                }
-                if (ob_status & RMI_F03_OB_FLAG_PARITY) {
-                    IOLogDebug("F03 Parity Flag");
-                    return kIOReturnSuccess;
-                }
-                
-                IOLogDebug("F03 - Recieved data over PS2: %x", ob_data);
-                if (!cmdcnt && !flags) {
-                    // Wait for start of packets
-                    if (index == 0 && ((ob_data == PS2_RET_ACK) || !(ob_data & 0x08)))
-                        continue;
-                    
-                    databuf[index++] = ob_data;
-                    
-                    if (index == 3)
-                        handlePacketGated(ob_data);
-                }
-                
-                // ps2_handle_response
-                if (cmdcnt)
-                    cmdbuf[--cmdcnt] = ob_data;
-                
-                if (flags & PS2_FLAG_CMD1) {
-                    flags &= ~PS2_FLAG_CMD1;
-                    if (cmdcnt)
-                        command_gate->commandWakeup(&status);
-                }
-                
-                if (flags & PS2_FLAG_ACK) {
-                    flags &= ~PS2_FLAG_ACK;
-                    command_gate->commandWakeup(&status);
-                }
-                
-                if (!cmdcnt) {
-                    flags &= ~PS2_FLAG_CMD;
-                    command_gate->commandWakeup(&status);
-                }
-            }
+            command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &F03::handleOutputBuffersGated),
+                                    obs, (void *) &ob_len);
             break;
         }
-        case kHandleRMIResume: {
-            u8 param[2] = {0};
-            u8 param1[2] = { TP_POR };
-            
-            int error = ps2Command(param, MAKE_PS2_CMD( 0, 2, TP_READ_ID));
-            error = ps2Command(param1, MAKE_PS2_CMD(1, 2, TP_COMMAND));
-            if (param1[0] != 0xAA || param1[1] != 0x00)
-                IOLogDebug("Got [%x, %x], should be [0xAA, 0x00]\n", param1[0], param1[1]);
-
-            error = ps2Command(NULL, PSMOUSE_CMD_ENABLE);
-                
+        case kHandleRMIResume:
+            if (command_gate)
+                initTrackpoint(true);
             break;
-        }
         case kHandleRMITrackpointButton: {
             // We do not lose any info casting to unsigned int.
             // This message originates in RMIBus::Notify, which sends an unsigned int
@@ -347,107 +350,462 @@ IOWorkLoop* F03::getWorkLoop()
     return work_loop;
 }
 
-int F03::ps2DoSendbyteGated(u8 byte, uint64_t timeout)
+/*
+ * Runs from the attention handler under the command gate, so bytes from
+ * the guest and PS/2 timeouts are never handled at the same time
+ */
+void F03::handleOutputBuffersGated(u8 *obs, u8 *len)
 {
-    AbsoluteTime time;
+    for (int i = 0; i < *len; i += RMI_F03_OB_SIZE) {
+        u8 ob_status = obs[i];
+        u8 ob_data = obs[i + RMI_F03_OB_DATA_OFFSET];
+        
+        if (!(ob_status & RMI_F03_RX_DATA_OFB))
+            continue;
+        
+        if (ob_status & RMI_F03_OB_FLAG_TIMEOUT) {
+            IOLogDebug("F03 Timeout Flag");
+            return;
+        }
+        if (ob_status & RMI_F03_OB_FLAG_PARITY) {
+            IOLogDebug("F03 Parity Flag");
+            return;
+        }
+        
+        IOLogDebug("F03 - Recieved data over PS2: %x", ob_data);
+        
+        if (ps2State != PS2_STATE_IDLE) {
+            ps2HandleByteGated(ob_data);
+            continue;
+        }
+        
+        // Wait for start of packets
+        if (index == 0 && ((ob_data == PS2_RET_ACK) || !(ob_data & 0x08)))
+            continue;
+        
+        databuf[index++] = ob_data;
+        
+        if (index == 3)
+            handlePacketGated(ob_data);
+    }
     
-    flags |= PS2_FLAG_ACK;
+    flushScroll(false);
+}
+
+/*
+ * Sends whole scroll units and keeps the remainder for next time.
+ * While the stick scrolls, what was sent also feeds the momentum velocity.
+ * Attentions don't come in at a fixed rate, so each one is turned into
+ * units per millisecond over the time since the last before it's averaged.
+ */
+void F03::flushScroll(bool momentum)
+{
+    SInt32 y = scrollAccY / RMI_FIXED_ONE;
+    SInt32 x = scrollAccX / RMI_FIXED_ONE;
     
-    int error = rmi_f03_pt_write(byte);
+    if (!momentum && isScrolling && scroll_timer) {
+        uint64_t now, elapsed;
+        clock_get_uptime(&now);
+        
+        if (scrollVelTS) {
+            absolutetime_to_nanoseconds(now - scrollVelTS, &elapsed);
+            // Two attentions can be handled back to back
+            if (elapsed < 1000000)
+                elapsed = 1000000;
+            
+            scrollVelY = (rmi_fixed)((scrollVelY + (SInt64)y * RMI_FIXED_ONE * 1000000 / (SInt64)elapsed) / 2);
+            scrollVelX = (rmi_fixed)((scrollVelX + (SInt64)x * RMI_FIXED_ONE * 1000000 / (SInt64)elapsed) / 2);
+        }
+        scrollVelTS = now;
+    }
+    
+    if ((!x && !y) || !voodooTrackpointInstance)
+        return;
+    
+    scrollAccY -= y * RMI_FIXED_ONE;
+    scrollAccX -= x * RMI_FIXED_ONE;
+    
+    scrollEvent.deltaAxis1 = y;
+    scrollEvent.deltaAxis2 = x;
+    scrollEvent.deltaAxis3 = 0;
+    clock_get_uptime(&scrollEvent.timestamp);
+    
+    messageClient(kIOMessageVoodooTrackpointScrollWheel, voodooTrackpointInstance, &scrollEvent, sizeof(ScrollWheelEvent));
+}
+
+void F03::startScrollMomentum(uint64_t timestamp)
+{
+    uint64_t window;
+    
+    if (!scroll_timer)
+        return;
+    
+    // Stick was held still before letting go
+    nanoseconds_to_absolutetime(SCROLL_MOMENTUM_WINDOW_MS * 1000000ULL, &window);
+    if (timestamp - lastScrollTS > window) {
+        scrollVelX = scrollVelY = 0;
+        return;
+    }
+    
+    scroll_timer->setTimeoutMS(SCROLL_MOMENTUM_INTERVAL_MS);
+}
+
+void F03::scrollMomentumTick(OSObject *owner, IOTimerEventSource *timer)
+{
+    scrollVelX = rmi_fixed_mul(scrollVelX, SCROLL_MOMENTUM_DECAY);
+    scrollVelY = rmi_fixed_mul(scrollVelY, SCROLL_MOMENTUM_DECAY);
+    
+    int vx = scrollVelX * SCROLL_MOMENTUM_INTERVAL_MS;
+    int vy = scrollVelY * SCROLL_MOMENTUM_INTERVAL_MS;
+    if (abs(vx) < SCROLL_MOMENTUM_MIN && abs(vy) < SCROLL_MOMENTUM_MIN) {
+        scrollVelX = scrollVelY = 0;
+        scrollAccX = scrollAccY = 0;
+        return;
+    }
+    
+    scrollAccX += vx;
+    scrollAccY += vy;
+    flushScroll(true);
+    
+    scroll_timer->setTimeoutMS(SCROLL_MOMENTUM_INTERVAL_MS);
+}
+
+/*
+ * Sending these are important to make the trackpoint work.
+ * But the responses don't work at all and it's voodoo how it actually works.
+ * Each step is queued from the completion of the last one, so start and
+ * resume return right away and the touchpad isn't held up by the trackpoint:
+ * READ_ID -> POR -> (registers) -> ENABLE
+ * POR is skipped on resume if the trackpoint still answers with its ID.
+ */
+void F03::initTrackpoint(bool resume)
+{
+    command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &F03::ps2FlushGated));
+    
+    tpResuming = resume;
+    tpPORSkipped = false;
+    tpReadIdTime = tpPORTime = tpEnableTime = 0;
+    clock_get_uptime(&tpInitStart);
+    
+    ps2Command(MAKE_PS2_CMD(0, 2, TP_READ_ID), NULL, &F03::readIdCompleted);
+}
+
+void F03::readIdCompleted(int error, u8 *result, u8 len)
+{
+    u8 param = TP_POR;
+    
+    if (error == -ECANCELED)
+        return;
+    
+    tpReadIdTime = ps2LastDuration;
+    
+    if (tpResuming && !error && len == 2 &&
+        result[0] >= TP_VARIANT_IBM && result[0] <= TP_VARIANT_NXP) {
+        IOLogDebug("F03 - Trackpoint answered [%x, %x], skipping POR\n", result[0], result[1]);
+        tpPORSkipped = true;
+        finishInit();
+        return;
+    }
+    
+    ps2Command(MAKE_PS2_CMD(1, 2, TP_COMMAND), &param, &F03::porCompleted);
+}
+
+void F03::finishInit()
+{
+    // POR puts every register back to its default
+    programTrackpoint();
+    ps2Command(PSMOUSE_CMD_ENABLE, NULL, &F03::enableCompleted);
+}
+
+void F03::enableCompleted(int error, u8 *result, u8 len)
+{
+    uint64_t now, total;
+    
+    if (error == -ECANCELED)
+        return;
+    
+    tpEnableTime = ps2LastDuration;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - tpInitStart, &total);
+    
+    OSDictionary *timings = OSDictionary::withCapacity(5);
+    if (!timings)
+        return;
+    
+    // All in microseconds
+    OSNumber *value = OSNumber::withNumber(tpReadIdTime / 1000, 64);
+    timings->setObject("Read ID", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(tpPORTime / 1000, 64);
+    timings->setObject("POR", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(tpEnableTime / 1000, 64);
+    timings->setObject("Enable", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(total / 1000, 64);
+    timings->setObject("Total", value);
+    OSSafeReleaseNULL(value);
+    timings->setObject("POR Skipped", tpPORSkipped ? kOSBooleanTrue : kOSBooleanFalse);
+    
+    setProperty("Trackpoint Init", timings);
+    OSSafeReleaseNULL(timings);
+}
+
+void F03::programTrackpoint()
+{
+    // Register is back at its default until the write below goes through
+    setHardwareScaling(false);
+    
+    if (tpSensitivity) {
+        u8 param[3] = { TP_WRITE_MEM, TP_SENS, tpSensitivity };
+        ps2Command(MAKE_PS2_CMD(3, 0, TP_COMMAND), param, &F03::sensitivityWritten);
+    }
+    
+    if (tpInertia) {
+        u8 param[3] = { TP_WRITE_MEM, TP_INERTIA, tpInertia };
+        ps2Command(MAKE_PS2_CMD(3, 0, TP_COMMAND), param);
+    }
+    
+    // Press to select can only be toggled, so see what it is first
+    if (tpPressToSelect) {
+        u8 param[2] = { TP_READ_MEM, TP_TOGGLE_PTSON };
+        ps2Command(MAKE_PS2_CMD(2, 1, TP_COMMAND), param, &F03::pressToSelectRead);
+    }
+}
+
+void F03::sensitivityWritten(int error, u8 *result, u8 len)
+{
     if (error) {
-        IOLogDebug("Failed to write to F03 device: %d\n", error);
+        IOLogDebug("F03 - Failed to write sensitivity, scaling in software: %d\n", error);
+        return;
     }
-    nanoseconds_to_absolutetime(timeout, &time);
-    IOReturn result = command_gate->commandSleep(&status, time, THREAD_ABORTSAFE);
-    status = 0;
     
-    if (result) {
-        int error = rmi_f03_pt_write(byte);
-        if (error) {
-            IOLogDebug("Failed to write to F03 device: %d\n", error);
-        }
-        result = command_gate->commandSleep(&status, time, THREAD_ABORTSAFE);
-        status = 0;
+    setHardwareScaling(true);
+}
+
+void F03::setHardwareScaling(bool enabled)
+{
+    trackstickMult = enabled ? hwMult : cfgMult;
+    trackstickScrollXMult = enabled ? hwScrollXMult : cfgScrollXMult;
+    trackstickScrollYMult = enabled ? hwScrollYMult : cfgScrollYMult;
+    setProperty("Hardware Scaling", enabled ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+void F03::pressToSelectRead(int error, u8 *result, u8 len)
+{
+    bool enabled = tpPressToSelect == 2;
+    
+    if (error || len != 1) {
+        IOLogDebug("F03 - Failed to read press to select: %d\n", error);
+        return;
     }
     
-    if (result == THREAD_TIMED_OUT)
-        error = THREAD_TIMED_OUT;
+    if (!!(result[0] & TP_MASK_PTSON) == enabled)
+        return;
     
-    flags &= ~PS2_FLAG_ACK;
+    tpPressToSelectOld = result[0];
     
-    return error;
+    u8 param[3] = { TP_TOGGLE, TP_TOGGLE_PTSON, TP_MASK_PTSON };
+    ps2Command(MAKE_PS2_CMD(3, 0, TP_COMMAND), param);
+    
+    // A toggle that went wrong is only undone by another toggle, so check it
+    u8 check[2] = { TP_READ_MEM, TP_TOGGLE_PTSON };
+    ps2Command(MAKE_PS2_CMD(2, 1, TP_COMMAND), check, &F03::pressToSelectToggled);
 }
 
-int F03::ps2CommandGated(u8 *param, unsigned int *cmd)
+void F03::pressToSelectToggled(int error, u8 *result, u8 len)
 {
-    unsigned int command = *cmd;
-    uint64_t timeout = 500 * 1000000;
-    unsigned int send = (command >> 12) & 0xf;
-    unsigned int receive = (command >> 8) & 0xf;
-    AbsoluteTime time;
-    int rc, i;
-    IOReturn res;
-    u8 send_param[16];
+    if (error || len != 1) {
+        IOLogDebug("F03 - Failed to read back press to select: %d\n", error);
+        return;
+    }
+    
+    if (result[0] == (tpPressToSelectOld ^ TP_MASK_PTSON))
+        return;
+    
+    IOLogError("F03 - Press to select reads 0x%02x after toggling 0x%02x\n",
+               result[0], tpPressToSelectOld);
     
-    memcpy(send_param, param, send);
-    flags = command == PS2_CMD_GETID ? PS2_FLAG_WAITID : 0;
-    cmdcnt = receive;
+    // Toggle never landed, nothing to undo
+    if (result[0] == tpPressToSelectOld)
+        return;
+    
+    u8 param[3] = { TP_TOGGLE, TP_TOGGLE_PTSON, TP_MASK_PTSON };
+    ps2Command(MAKE_PS2_CMD(3, 0, TP_COMMAND), param);
+}
+
+void F03::porCompleted(int error, u8 *result, u8 len)
+{
+    if (error == -ECANCELED)
+        return;
+    
+    tpPORTime = ps2LastDuration;
+    
+    if (error || len != 2 || result[0] != PS2_RET_BAT || result[1] != PS2_RET_ID)
+        IOLogDebug("POR returned %d, got [%x, %x], should be [0xAA, 0x00]\n",
+                   error, len > 0 ? result[0] : 0, len > 1 ? result[1] : 0);
+    
+    // Carry on either way, it usually works regardless
+    finishInit();
+}
+
+int F03::ps2Command(unsigned int command, const u8 *param, PS2Completion done)
+{
+    f03_ps2_cmd cmd {command, {0}, done};
+    unsigned int send = (command >> 12) & 0xf;
     
-    if (receive && param)
-        for (i = 0; i < receive;i++)
-            cmdbuf[(receive - 1) - i] = param[i];
+    if (send > PS2_MAX_PARAMS || ((command >> 8) & 0xf) > PS2_MAX_RESULTS)
+        return -EINVAL;
     
-    /* Signal that we are sending the command byte */
-    flags |= PS2_FLAG_ACK_CMD;
+    if (send && param)
+        memcpy(cmd.param, param, send);
     
-    rc = ps2DoSendbyteGated(command & 0xff, timeout);
-    if (rc) {
-        goto out_reset_flags;
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &F03::ps2EnqueueGated), &cmd);
+}
+
+int F03::ps2EnqueueGated(f03_ps2_cmd *cmd)
+{
+    if (ps2Count == PS2_QUEUE_SIZE) {
+        IOLogError("F03 - PS2 queue full, dropping %x\n", cmd->command);
+        return -EBUSY;
     }
-        
-    /* Now we are sending command parameters, if any */
-    flags &= ~PS2_FLAG_ACK_CMD;
     
-    for (i = 0; i < send; i++) {
-        rc = ps2DoSendbyteGated(param[i], timeout);
-        if (rc) {
-            goto out_reset_flags;
-        }
+    ps2Queue[(ps2Head + ps2Count++) % PS2_QUEUE_SIZE] = *cmd;
+    
+    if (ps2State == PS2_STATE_IDLE)
+        ps2StartNextGated();
+    
+    return 0;
+}
+
+void F03::ps2StartNextGated()
+{
+    if (!ps2Count) {
+        ps2State = PS2_STATE_IDLE;
+        // Don't let a half packet from before the commands linger
+        index = 0;
+        return;
     }
     
-    timeout = command == PS2_CMD_RESET_BAT ? 4000 : 500;
+    ps2Sent = 0;
+    ps2Received = 0;
+    ps2Retried = false;
+    clock_get_uptime(&ps2CmdStart);
+    ps2State = PS2_STATE_WAIT_ACK;
+    ps2SendByteGated();
+}
+
+/*
+ * Sends the command byte first, then each parameter byte, each one
+ * waiting on its own ACK
+ */
+void F03::ps2SendByteGated()
+{
+    f03_ps2_cmd *cmd = &ps2Queue[ps2Head];
+    u8 byte = ps2Sent ? cmd->param[ps2Sent - 1] : cmd->command & 0xff;
     
-    flags |= PS2_FLAG_CMD1 | PS2_FLAG_CMD;
-    nanoseconds_to_absolutetime(timeout * 1000000, &time);
-    res = command_gate->commandSleep(&status, time, THREAD_ABORTSAFE);
-    status = 0;
-    if (cmdcnt && !(flags & PS2_FLAG_CMD1)) {
-        res = command_gate->commandSleep(&status, time, THREAD_ABORTSAFE);
-        status = 0;
+    int error = rmi_f03_pt_write(byte);
+    if (error) {
+        IOLogDebug("Failed to write to F03 device: %d\n", error);
     }
     
-    if (param)
-        for (i = 0; i < receive; i++)
-            param[i] = cmdbuf[(receive - 1) - i];
+    ps2_timer->setTimeoutMS(PS2_ACK_TIMEOUT_MS);
+}
+
+void F03::ps2HandleByteGated(u8 data)
+{
+    f03_ps2_cmd *cmd = &ps2Queue[ps2Head];
+    unsigned int send = (cmd->command >> 12) & 0xf;
+    unsigned int receive = (cmd->command >> 8) & 0xf;
+    
+    switch (ps2State) {
+        case PS2_STATE_WAIT_ACK:
+            // Device asked for the byte again
+            if (data == PS2_RET_NAK && !ps2Retried) {
+                ps2Retried = true;
+                ps2SendByteGated();
+                return;
+            }
+            
+            // Responses aren't reliable (see above), so take anything else as an ACK
+            ps2Sent++;
+            ps2Retried = false;
+            
+            if (ps2Sent <= send) {
+                ps2SendByteGated();
+            } else if (receive) {
+                ps2State = PS2_STATE_WAIT_DATA;
+                ps2_timer->setTimeoutMS(cmd->command == PS2_CMD_RESET_BAT ?
+                                        PS2_RESET_TIMEOUT_MS : PS2_ACK_TIMEOUT_MS);
+            } else {
+                ps2CompleteGated(0);
+            }
+            break;
+        case PS2_STATE_WAIT_DATA:
+            ps2Result[ps2Received++] = data;
+            if (ps2Received == receive)
+                ps2CompleteGated(0);
+            break;
+        default:
+            break;
+    }
+}
+
+void F03::ps2TimeoutOccured(OSObject *owner, IOTimerEventSource *timer)
+{
+    if (ps2State == PS2_STATE_IDLE)
+        return;
     
-    if (cmdcnt &&
-        (command != PS2_CMD_RESET_BAT || cmdcnt != 1)) {
-        // Multibyte commands
-        //        rc = -EPROTO;
-        goto out_reset_flags;
+    // Send once more before giving up, same as before
+    if (ps2State == PS2_STATE_WAIT_ACK && !ps2Retried) {
+        ps2Retried = true;
+        ps2SendByteGated();
+        return;
     }
     
-    rc = 0;
+    IOLogDebug("F03 - PS2 command %x timed out\n", ps2Queue[ps2Head].command);
+    ps2CompleteGated(-ETIMEDOUT);
+}
+
+void F03::ps2CompleteGated(int error)
+{
+    f03_ps2_cmd cmd = ps2Queue[ps2Head];
+    
+    ps2_timer->cancelTimeout();
+    
+    uint64_t now;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - ps2CmdStart, &ps2LastDuration);
+    
+    ps2Head = (ps2Head + 1) % PS2_QUEUE_SIZE;
+    ps2Count--;
+    ps2State = PS2_STATE_IDLE;
+    
+    if (cmd.done)
+        (this->*cmd.done)(error, ps2Result, ps2Received);
     
-out_reset_flags:
-    flags = 0;
-    return rc;
+    // The callback may have queued (and so started) a command already
+    if (ps2State == PS2_STATE_IDLE)
+        ps2StartNextGated();
 }
 
-int F03::ps2Command(u8 *param, unsigned int command)
+/*
+ * Drops whatever is left from before a reset, the device won't answer it
+ */
+void F03::ps2FlushGated()
 {
-    return command_gate->attemptAction(OSMemberFunctionCast(IOCommandGate::Action, this, &F03::ps2CommandGated),
-                                       param, &command);
+    ps2_timer->cancelTimeout();
+    ps2State = PS2_STATE_IDLE;
+    
+    while (ps2Count) {
+        f03_ps2_cmd cmd = ps2Queue[ps2Head];
+        
+        ps2Head = (ps2Head + 1) % PS2_QUEUE_SIZE;
+        ps2Count--;
+        
+        if (cmd.done)
+            (this->*cmd.done)(-ECANCELED, ps2Result, 0);
+    }
 }
 
 bool F03::handleOpen(IOService *forClient, IOOptionBits options, void *arg)
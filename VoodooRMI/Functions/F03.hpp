@@ -16,6 +16,7 @@
 #include <VoodooTrackpointMessages.h>
 #include <IOKit/IOWorkLoop.h>
 #include <IOKit/IOCommandGate.h>
+#include <IOKit/IOTimerEventSource.h>
 
 #define PSMOUSE_CMD_ENABLE 0x00f4
 #define DEFAULT_MULT 20
@@ -31,6 +32,9 @@
 
 #define TP_READ_ID        0xE1    /* Sent for device identification */
 
+#define TP_VARIANT_IBM        0x01
+#define TP_VARIANT_NXP        0x04
+
 #define RMI_F03_RX_DATA_OFB        0x01
 #define RMI_F03_OB_SIZE            2
 
@@ -69,12 +73,66 @@
  * Register oriented commands/properties
  */
 #define TP_WRITE_MEM        0x81
+#define TP_READ_MEM        0x80
+#define TP_TOGGLE        0x47    /* Toggle bit */
+
+/*
+ * RAM Locations for properties
+ */
+#define TP_SENS            0x4A    /* Sensitivity */
+#define TP_INERTIA        0x4D    /* Negative Inertia Factor (Don't change!!!) */
+
+/*
+ * Toggling Flag bits
+ */
+#define TP_TOGGLE_PTSON        0x2C    /* Press to Select */
+#define TP_MASK_PTSON            0x01
+
+#define TP_DEF_SENS        0x80
 
 /* Power on Self Test Results */
 #define TP_POR_SUCCESS        0x3B
 
 #define MAKE_PS2_CMD(params, results, cmd) ((params<<12) | (results<<8) | (cmd))
 
+/*
+ * PS/2 commands are queued and run as a state machine, advanced by bytes
+ * coming back through the F03 output buffers and by a timeout timer.
+ * Nothing ever sleeps waiting on the guest device.
+ */
+#define PS2_QUEUE_SIZE          8
+#define PS2_MAX_PARAMS          4
+#define PS2_MAX_RESULTS         4
+#define PS2_ACK_TIMEOUT_MS      500
+#define PS2_RESET_TIMEOUT_MS    4000
+
+/*
+ * Scroll deltas are kept in fixed point so slow scrolling isn't rounded
+ * away. Momentum is ticked every SCROLL_MOMENTUM_INTERVAL_MS and decays by
+ * SCROLL_MOMENTUM_DECAY each tick, until a tick moves less than
+ * SCROLL_MOMENTUM_MIN.
+ */
+#define SCROLL_MOMENTUM_INTERVAL_MS     10
+#define SCROLL_MOMENTUM_DECAY           RMI_FIXED_RATIO(9, 10)
+#define SCROLL_MOMENTUM_MIN             (RMI_FIXED_ONE / 4)
+// Only start momentum if the stick was still moving this close to the release
+#define SCROLL_MOMENTUM_WINDOW_MS       50
+
+class F03;
+typedef void (F03::*PS2Completion)(int error, u8 *result, u8 len);
+
+struct f03_ps2_cmd {
+    unsigned int command;
+    u8 param[PS2_MAX_PARAMS];
+    PS2Completion done;
+};
+
+enum f03_ps2_state {
+    PS2_STATE_IDLE,
+    PS2_STATE_WAIT_ACK,     // Waiting on the ACK for command or parameter byte
+    PS2_STATE_WAIT_DATA,    // Waiting on result bytes
+};
+
 
 class F03 : public RMIFunction {
     OSDeclareDefaultStructors(F03)
@@ -93,6 +151,8 @@ private:
     RMIBus *rmiBus;
     IOWorkLoop *work_loop;
     IOCommandGate *command_gate;
+    IOTimerEventSource *ps2_timer {nullptr};
+    IOTimerEventSource *scroll_timer {nullptr};
     
     IOService *voodooTrackpointInstance {nullptr};
     RelativePointerEvent relativeEvent {};
@@ -103,13 +163,43 @@ private:
     unsigned int trackstickScrollYMult;
     unsigned int trackstickDeadzone;
     
+    // Multipliers as configured, and what's left of them once the trackpoint scales by tpSensitivity
+    unsigned int cfgMult, cfgScrollXMult, cfgScrollYMult;
+    unsigned int hwMult, hwScrollXMult, hwScrollYMult;
+    
+    // Written to the trackpoint on start/resume, 0 leaves the firmware value
+    u8 tpSensitivity {0};
+    u8 tpInertia {0};
+    u8 tpPressToSelect {0};
+    // Register value before press to select was toggled, to check the toggle against
+    u8 tpPressToSelectOld {0};
+    
     bool isScrolling;
     bool middlePressed;
     
+    // Scroll engine, in Q16.16 scroll units
+    bool scrollMomentum {false};
+    rmi_fixed scrollAccX {0}, scrollAccY {0};
+    // Momentum velocity in scroll units per millisecond
+    rmi_fixed scrollVelX {0}, scrollVelY {0};
+    uint64_t lastScrollTS {0};
+    // When the velocity last took a sample, 0 until the first one this scroll
+    uint64_t scrollVelTS {0};
+    
     // ps2
-    unsigned int flags, cmdcnt;
-    u8 cmdbuf[8];
-    u8 status {0};
+    f03_ps2_cmd ps2Queue[PS2_QUEUE_SIZE];
+    u8 ps2Head {0}, ps2Count {0};
+    f03_ps2_state ps2State {PS2_STATE_IDLE};
+    u8 ps2Sent, ps2Received;
+    u8 ps2Result[PS2_MAX_RESULTS];
+    bool ps2Retried;
+    uint64_t ps2CmdStart, ps2LastDuration;
+    
+    // Trackpoint init timings, in ns
+    bool tpResuming;
+    bool tpPORSkipped;
+    uint64_t tpInitStart;
+    uint64_t tpReadIdTime, tpPORTime, tpEnableTime;
     
     // Packet storage
     u8 databuf[3];
@@ -124,13 +214,33 @@ private:
     IOWorkLoop* getWorkLoop();
     
     int rmi_f03_pt_write (unsigned char val);
-    int ps2DoSendbyteGated(u8 byte, uint64_t timeout);
-    int ps2CommandGated(u8 *param, unsigned int *command);
-    int ps2Command(u8 *param, unsigned int command);
+    int ps2Command(unsigned int command, const u8 *param = NULL, PS2Completion done = NULL);
+    int ps2EnqueueGated(f03_ps2_cmd *cmd);
+    void ps2StartNextGated();
+    void ps2SendByteGated();
+    void ps2HandleByteGated(u8 data);
+    void ps2CompleteGated(int error);
+    void ps2FlushGated();
+    void ps2TimeoutOccured(OSObject *owner, IOTimerEventSource *timer);
+    
+    void initTrackpoint(bool resume);
+    void readIdCompleted(int error, u8 *result, u8 len);
+    void porCompleted(int error, u8 *result, u8 len);
+    void finishInit();
+    void enableCompleted(int error, u8 *result, u8 len);
+    void programTrackpoint();
+    void sensitivityWritten(int error, u8 *result, u8 len);
+    void setHardwareScaling(bool enabled);
+    void pressToSelectRead(int error, u8 *result, u8 len);
+    void pressToSelectToggled(int error, u8 *result, u8 len);
+    void handleOutputBuffersGated(u8 *obs, u8 *len);
     // TODO: Move to math file as long as with abs in rmi_driver.h
     int signum (int value);
     
     void handlePacketGated(u8 packet);
+    void flushScroll(bool momentum);
+    void startScrollMomentum(uint64_t timestamp);
+    void scrollMomentumTick(OSObject *owner, IOTimerEventSource *timer);
 };
 
 #endif /* F03_hpp */
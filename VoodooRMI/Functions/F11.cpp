@@ -63,6 +63,7 @@ bool F11::start(IOService *provider)
     if (rc < 0)
         return !rc;
     
+    rmiBus->pinRead(fn_descriptor->data_base_addr, sensor->pkt_size);
     registerService();
     
     if(!sensor->attach(this))
@@ -94,7 +95,7 @@ IOReturn F11::message(UInt32 type, IOService *provider, void *argument)
     switch (type)
     {
         case kHandleRMIAttention:
-            getReport();
+            getReport(*reinterpret_cast<AbsoluteTime *>(argument));
             break;
         case kHandleRMIClickpadSet:
         case kHandleRMITrackpoint:
@@ -104,27 +105,40 @@ IOReturn F11::message(UInt32 type, IOService *provider, void *argument)
     return kIOReturnSuccess;
 }
 
-bool F11::getReport()
+bool F11::getReport(AbsoluteTime timestamp)
 {
-    int error, fingers, abs_size;
-    u8 finger_state;
-    AbsoluteTime timestamp;
+    int error;
     
     if (!sensor)
         return false;
     
-    error = rmiBus->readBlock(fn_descriptor->data_base_addr,
-                              sensor->data_pkt, sensor->pkt_size);
+    error = sensor->readReport(fn_descriptor->data_base_addr, timestamp,
+                               this, &F11::readCompleted);
+    if (error <= 0)
+        return !error;
     
-    if (error < 0) {
-        IOLogError("Could not read F11 attention data: %d", error);
-        return false;
-    }
+    return parseReport(timestamp);
+}
+
+void F11::readCompleted(OSObject *owner, void *context, int result,
+                        const rmi_transfer_stats *stats)
+{
+    F11 *self = OSDynamicCast(F11, owner);
+    AbsoluteTime timestamp;
+    
+    if (!self)
+        return;
     
-    clock_get_uptime(&timestamp);
+    if (self->sensor->takeReport(self, context, result, &timestamp))
+        self->parseReport(timestamp);
     
-    if (sensor->shouldDiscardReport(timestamp))
-        return true;
+    self->sensor->readCompleted(context, result, stats);
+}
+
+bool F11::parseReport(AbsoluteTime timestamp)
+{
+    int fingers, abs_size;
+    u8 finger_state;
     
     IOLogDebug("F11 Packet");
     
@@ -150,6 +164,8 @@ bool F11::getReport()
         report.objs[i].wx = pos_data[3] & 0x0f;
         report.objs[i].wy = pos_data[3] >> 4;
         report.objs[i].type = finger_state == F11_PRESENT ? RMI_2D_OBJECT_FINGER : RMI_2D_OBJECT_NONE;
+        
+        sensor->alignObject(&report.objs[i]);
     }
     
     report.timestamp = timestamp;
@@ -230,7 +246,7 @@ int F11::f11_2d_construct_data()
     
     sensor->data_pkt = reinterpret_cast<u8*>(IOMalloc(sensor->pkt_size));
     
-    if (!sensor->data_pkt)
+    if (!sensor->data_pkt || !sensor->allocRxBuffers())
         return -ENOMEM;
     
     data->f_state = sensor->data_pkt;
@@ -247,18 +263,12 @@ int F11::f11_2d_construct_data()
 // Tbh, we probably don't need most of this. This is more for troubleshooting/looking cool in IOReg
 // I'm implementing because I'm curious...no other good reason
 int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
-                                 u16 query_base_addr)
+                                       const u8 *queries)
 {
     int query_size;
-    int rc;
-    u8 query_buf[RMI_F11_QUERY_SIZE];
+    const u8 *query_buf = queries;
     bool has_query36 = false;
     
-    rc = rmiBus->readBlock(query_base_addr, query_buf,
-                        RMI_F11_QUERY_SIZE);
-    if (rc < 0)
-        return rc;
-    
     sensor_query->nr_fingers = query_buf[0] & RMI_F11_NR_FINGERS_MASK;
     sensor_query->has_rel = !!(query_buf[0] & RMI_F11_HAS_REL);
     sensor_query->has_abs = !!(query_buf[0] & RMI_F11_HAS_ABS);
@@ -287,9 +297,7 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
     query_size = RMI_F11_QUERY_SIZE;
     
     if (sensor_query->has_abs) {
-        rc = rmiBus->read(query_base_addr + query_size, query_buf);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         sensor_query->abs_data_size =
             query_buf[0] & RMI_F11_ABS_DATA_SIZE_MASK;
@@ -321,18 +329,12 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
     }
     
     if (sensor_query->has_rel) {
-        rc = rmiBus->read(query_base_addr + query_size,
-                      &sensor_query->f11_2d_query6);
-        if (rc < 0)
-            return rc;
+        sensor_query->f11_2d_query6 = queries[query_size];
         query_size++;
     }
     
     if (sensor_query->has_gestures) {
-        rc = rmiBus->readBlock(query_base_addr + query_size,
-                            query_buf, RMI_F11_QUERY_GESTURE_SIZE);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         sensor_query->has_single_tap =
             !!(query_buf[0] & RMI_F11_HAS_SINGLE_TAP);
@@ -397,9 +399,7 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
     }
     
     if (has_query9) {
-        rc = rmiBus->read(query_base_addr + query_size, query_buf);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         sensor_query->has_pen =
             !!(query_buf[0] & RMI_F11_HAS_PEN);
@@ -434,9 +434,7 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
     }
     
     if (sensor_query->has_touch_shapes) {
-        rc = rmiBus->read(query_base_addr + query_size, query_buf);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         sensor_query->nr_touch_shapes = query_buf[0] &
             RMI_F11_NR_TOUCH_SHAPES_MASK;
@@ -447,9 +445,7 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
     }
     
     if (has_query11) {
-        rc = rmiBus->read(query_base_addr + query_size, query_buf);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         sensor_query->has_z_tuning =
             !!(query_buf[0] & RMI_F11_HAS_Z_TUNING);
@@ -484,9 +480,7 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
     }
     
     if (has_query12) {
-        rc = rmiBus->read(query_base_addr + query_size, query_buf);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         sensor_query->has_gapless_finger =
             !!(query_buf[0] & RMI_F11_HAS_GAPLESS_FINGER);
@@ -520,9 +514,7 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
     }
     
     if (sensor_query->has_jitter_filter) {
-        rc = rmiBus->read(query_base_addr + query_size, query_buf);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         sensor_query->jitter_window_size = query_buf[0] &
                                             RMI_F11_JITTER_WINDOW_MASK;
@@ -539,9 +531,7 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
     }
     
     if (sensor_query->has_info2) {
-        rc = rmiBus->read(query_base_addr + query_size, query_buf);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         sensor_query->light_control =
             query_buf[0] & RMI_F11_LIGHT_CONTROL_MASK;
@@ -568,10 +558,7 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
     }
     
     if (sensor_query->has_physical_props) {
-        rc = rmiBus->readBlock(query_base_addr
-                            + query_size, query_buf, 4);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         sensor_query->x_sensor_size_mm =
             (query_buf[0] | (query_buf[1] << 8)) / 10;
@@ -600,20 +587,14 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
      * The check for has_query36 in here suggests not though
      */
     if (has_query28) {
-        rc = rmiBus->read(query_base_addr + query_size,
-                      query_buf);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         has_query36 = !!(query_buf[0] & BIT(6));
     }
     
     if (has_query36) {
         query_size += 2;
-        rc = rmiBus->read(query_base_addr + query_size,
-                          query_buf);
-        if (rc < 0)
-            return rc;
+        query_buf = &queries[query_size];
         
         if (!!(query_buf[0] & BIT(5)))
             has_acm = true;
@@ -624,9 +605,10 @@ int F11::rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
 
 int F11::rmi_f11_initialize()
 {
-    u8 query_offset, buf;
+    u8 queries[RMI_F11_QUERY_SPAN];
     u16 query_base_addr, control_base_addr;
-    u16 max_x_pos, max_y_pos;
+    u16 max_pos[2];
+    UInt32 transactions;
     int rc;
     
     // supposed to be default platform data - I can't find it though
@@ -636,26 +618,28 @@ int F11::rmi_f11_initialize()
     query_base_addr = fn_descriptor->query_base_addr;
     control_base_addr = fn_descriptor->control_base_addr;
     
-    rc = rmiBus->read(query_base_addr, &buf);
+    /*
+     * Every optional query register fits in one block, so read all of them
+     * and parse from memory instead of a transaction per register
+     */
+    transactions = rmiBus->transactions;
+    rc = rmiBus->readBlock(query_base_addr, queries, RMI_F11_QUERY_SPAN);
     if (rc < 0) {
-        IOLogError("F11: Could not read Query Base Addr\n");
+        IOLogError("F11: Could not read Query Registers\n");
         return rc;
     }
     
-    has_query9 = !!(buf & RMI_F11_HAS_QUERY9);
-    has_query11 = !!(buf & RMI_F11_HAS_QUERY11);
-    has_query12 = !!(buf & RMI_F11_HAS_QUERY12);
-    has_query27 = !!(buf & RMI_F11_HAS_QUERY27);
-    has_query28 = !!(buf & RMI_F11_HAS_QUERY28);
-    
-    query_offset = (query_base_addr + 1);
+    has_query9 = !!(queries[0] & RMI_F11_HAS_QUERY9);
+    has_query11 = !!(queries[0] & RMI_F11_HAS_QUERY11);
+    has_query12 = !!(queries[0] & RMI_F11_HAS_QUERY12);
+    has_query27 = !!(queries[0] & RMI_F11_HAS_QUERY27);
+    has_query28 = !!(queries[0] & RMI_F11_HAS_QUERY28);
     
-    rc = rmi_f11_get_query_parameters(&sens_query, query_offset);
+    rc = rmi_f11_get_query_parameters(&sens_query, &queries[1]);
     if (rc < 0) {
         IOLogError("F11: Could not read Sensor Query");
         return rc;
     }
-    query_offset += rc;
     
     if (sens_query.has_physical_props) {
         sensor->x_mm = sens_query.x_sensor_size_mm;
@@ -670,22 +654,18 @@ int F11::rmi_f11_initialize()
         return -ENODEV;
     }
     
+    // Max Y directly follows max X
     rc = rmiBus->readBlock(control_base_addr + F11_CTRL_SENSOR_MAX_X_POS_OFFSET,
-                           (u8 *)&max_x_pos, sizeof(max_x_pos));
+                           (u8 *)max_pos, sizeof(max_pos));
     if (rc < 0) {
-        IOLogError("F11: Could not read max x\n");
+        IOLogError("F11: Could not read max x/y\n");
         return rc;
     }
     
-    rc = rmiBus->readBlock(control_base_addr + F11_CTRL_SENSOR_MAX_Y_POS_OFFSET,
-                           (u8 *)&max_y_pos, sizeof(max_y_pos));
-    if (rc < 0) {
-        IOLogError("F11: Could not read max y\n");
-        return rc;
-    }
+    setProperty("Query Transactions", rmiBus->transactions - transactions, 32);
         
-    sensor->max_x = max_x_pos;
-    sensor->max_y = max_y_pos;
+    sensor->max_x = max_pos[0];
+    sensor->max_y = max_pos[1];
     
     rc = f11_2d_construct_data();
     if (rc < 0) {
@@ -713,6 +693,14 @@ int F11::rmi_f11_initialize()
         dev_controls.ctrl0_11[11] &= ~BIT(0);
     }
     
+    if (sensor->axis_align.delta_x_threshold)
+        dev_controls.ctrl0_11[RMI_F11_DELTA_X_THRESHOLD] =
+            sensor->axis_align.delta_x_threshold;
+    
+    if (sensor->axis_align.delta_y_threshold)
+        dev_controls.ctrl0_11[RMI_F11_DELTA_Y_THRESHOLD] =
+            sensor->axis_align.delta_y_threshold;
+    
     rc = f11_write_control_regs(&sens_query,
                                 &dev_controls, fn_descriptor->control_base_addr);
     if (rc)
@@ -170,6 +170,8 @@
 #define RMI_F11_HAS_ADVANCED_GESTURES           (1 << 7)
 
 #define RMI_F11_QUERY_SIZE                      4
+/* Query 0 through query 36, with every optional register present */
+#define RMI_F11_QUERY_SPAN                      31
 #define RMI_F11_QUERY_GESTURE_SIZE              2
 
 #define F11_LIGHT_CTL_NONE 0x00
@@ -548,10 +550,13 @@ private:
     unsigned long *abs_mask;
     unsigned long *rel_mask;
     
-    bool getReport();
+    bool getReport(AbsoluteTime timestamp);
+    bool parseReport(AbsoluteTime timestamp);
+    static void readCompleted(OSObject *owner, void *context, int result,
+                              const rmi_transfer_stats *stats);
     int rmi_f11_initialize();
     int rmi_f11_get_query_parameters(f11_2d_sensor_queries *sensor_query,
-                                      u16 query_base_addr);
+                                     const u8 *queries);
     int f11_read_control_regs(f11_2d_ctrl *ctrl, u16 ctrl_base_addr);
     int f11_write_control_regs(f11_2d_sensor_queries *query,
                                f11_2d_ctrl *ctrl,
@@ -83,7 +83,7 @@ bool F12::attach(IOService *provider)
     
     sensor->data_pkt = reinterpret_cast<u8 *>(IOMalloc(sensor->pkt_size));
     
-    if (!sensor->data_pkt)
+    if (!sensor->data_pkt || !sensor->allocRxBuffers())
         return -ENOMEM;
     
     ret = rmi_f12_read_sensor_tuning();
@@ -192,6 +192,7 @@ bool F12::start(IOService *provider)
         }
     }
     
+    rmiBus->pinRead(fn_descriptor->data_base_addr, sensor->pkt_size);
     registerService();
     
     if (!sensor->attach(this))
@@ -222,7 +223,7 @@ IOReturn F12::message(UInt32 type, IOService *provider, void *argument)
     switch (type)
     {
         case kHandleRMIAttention:
-            getReport();
+            getReport(*reinterpret_cast<AbsoluteTime *>(argument));
             break;
         case kHandleRMIClickpadSet:
         case kHandleRMITrackpoint:
@@ -310,25 +311,33 @@ int F12::rmi_f12_read_sensor_tuning()
     return 0;
 }
 
-void F12::getReport()
+void F12::getReport(AbsoluteTime timestamp)
 {
-    AbsoluteTime timestamp;
-    
     if (!sensor || !data1)
         return;
     
-    int retval = rmiBus->readBlock(fn_descriptor->data_base_addr, sensor->data_pkt,
-                                   sensor->pkt_size);
+    if (sensor->readReport(fn_descriptor->data_base_addr, timestamp,
+                           this, &F12::readCompleted) > 0)
+        parseReport(timestamp);
+}
+
+void F12::readCompleted(OSObject *owner, void *context, int result,
+                        const rmi_transfer_stats *stats)
+{
+    F12 *self = OSDynamicCast(F12, owner);
+    AbsoluteTime timestamp;
     
-    if (retval < 0) {
-        IOLogError("F12 - Failed to read object data. Code: %d\n", retval);
+    if (!self)
         return;
-    }
     
-    clock_get_uptime(&timestamp);
-    if (sensor->shouldDiscardReport(timestamp))
-        return;
+    if (self->sensor->takeReport(self, context, result, &timestamp))
+        self->parseReport(timestamp);
     
+    self->sensor->readCompleted(context, result, stats);
+}
+
+void F12::parseReport(AbsoluteTime timestamp)
+{
     IOLogDebug("F12 Packet");
 #if DEBUG
     if (sensor->nbr_fingers > 5) {
@@ -359,6 +368,8 @@ void F12::getReport()
         obj->wx = data[6];
         obj->wy = data[7];
         
+        sensor->alignObject(obj);
+        
         data += F12_DATA1_BYTES_PER_OBJ;
     }
     
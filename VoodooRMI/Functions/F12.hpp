@@ -105,8 +105,10 @@ private:
     int rmi_read_register_desc(u16 addr,
                                rmi_register_descriptor *rdesc);
     
-    void getReport();
-    
+    void getReport(AbsoluteTime timestamp);
+    void parseReport(AbsoluteTime timestamp);
+    static void readCompleted(OSObject *owner, void *context, int result,
+                              const rmi_transfer_stats *stats);
 };
 
 #endif /* F12_hpp */
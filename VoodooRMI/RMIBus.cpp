@@ -8,7 +8,6 @@
 
 OSDefineMetaClassAndStructors(RMIBus, IOService)
 OSDefineMetaClassAndStructors(RMIFunction, IOService)
-OSDefineMetaClassAndStructors(RMITransport, IOService)
 #define super IOService
 
 bool RMIBus::init(OSDictionary *dictionary) {
@@ -21,10 +20,17 @@ bool RMIBus::init(OSDictionary *dictionary) {
     
     data->irq_mutex = IOLockAlloc();
     data->enabled_mutex = IOLockAlloc();
+    slow_frame_lock = IOLockAlloc();
+    if (!slow_frame_lock) return false;
+    
+    data->topology = reinterpret_cast<rmi_topology_cache *>(IOMalloc(sizeof(rmi_topology_cache)));
+    if (!data->topology) return false;
+    memset(data->topology, 0, sizeof(rmi_topology_cache));
     
     bool result = super::init(dictionary);
     
     config = OSDynamicCast(OSDictionary, getProperty("Configuration"));
+    frame_budget_us = Configuration::loadUInt32Configuration(config, "FrameBudget", 10) * 1000;
     return result;
 }
 
@@ -62,11 +68,30 @@ bool RMIBus::start(IOService *provider) {
     retval = rmi_init_functions(this, data);
     if (retval)
         goto err;
+    
+    // Read on every single interrupt
+    pinRead(data->f01_container->fd.data_base_addr + 1, data->num_of_irq_regs);
 
     retval = rmi_enable_sensor(this);
     if (retval)
         goto err;
     
+    work_loop = IOWorkLoop::workLoop();
+    command_gate = IOCommandGate::commandGate(this);
+    if (!work_loop || !command_gate || work_loop->addEventSource(command_gate) != kIOReturnSuccess) {
+        IOLogError("%s Could not create command gate, failing reads won't reset the device\n", getName());
+        OSSafeReleaseNULL(command_gate);
+    }
+    
+    // Without the gate a recovery could run in the middle of sleep or wake
+    if (command_gate) {
+        recovery_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &RMIBus::recoverSensor));
+        if (!recovery_timer || work_loop->addEventSource(recovery_timer) != kIOReturnSuccess) {
+            IOLogError("%s Could not create recovery timer, failing reads won't reset the device\n", getName());
+            OSSafeReleaseNULL(recovery_timer);
+        }
+    }
+    
     PMinit();
     provider->joinPMtree(this);
     registerPowerDriver(this, RMIPowerStates, 2);
@@ -84,7 +109,11 @@ err:
 
 void RMIBus::handleHostNotify()
 {
-    unsigned long mask, irqStatus, movingMask = 1;
+    RMIFunction *func, *last = nullptr;
+    struct rmi_slow_frame frame {};
+    AbsoluteTime start, status;
+    int words;
+    
     if (!data) {
         IOLogError("Interrupt - No data\n");
         return;
@@ -94,44 +123,183 @@ void RMIBus::handleHostNotify()
         return;
     }
     
-    int error = readBlock(data->f01_container->fd.data_base_addr + 1,
-                          reinterpret_cast<u8*>(&irqStatus), data->num_of_irq_regs);
+    clock_get_uptime(&start);
+    attention_frame = &frame;
+    attention_thread = current_thread();
     
-    data->irq_status = irqStatus;
+    // irq_status belongs to rmi_driver_set_irq_bits, which can run from recovery or wake
+    int error = readBlock(data->f01_container->fd.data_base_addr + 1,
+                          reinterpret_cast<u8*>(data->attn_status), data->num_of_irq_regs);
+    clock_get_uptime(&status);
     
     if (error < 0){
         IOLogError("Unable to read IRQ\n");
+        checkFrameBudget(&frame, start, status);
         return;
     }
     
+    words = BITS_TO_LONGS(data->irq_count);
+    
     IOLockLock(data->irq_mutex);
-    mask = data->irq_status & data->fn_irq_bits;
+    for (int i = 0; i < words; i++)
+        data->attn_status[i] &= data->fn_irq_bits[i];
     IOLockUnlock(data->irq_mutex);
     
     OSIterator* iter = OSCollectionIterator::withCollection(functions);
     
-    while (mask) {
-        if (!(mask & movingMask)) {
-            mask &= ~movingMask;
-            movingMask <<=1;
-            continue;
-        }
+    for (int i = 0; i < words; i++) {
+        unsigned long pending = data->attn_status[i];
         
-        while(RMIFunction *func = OSDynamicCast(RMIFunction, iter->getNextObject())) {
-            if (func->getIRQ() & movingMask) {
-                messageClient(kHandleRMIAttention, func);
-                
-                mask &= ~movingMask;
-                break;
+        while (pending) {
+            unsigned int bit = i * BITS_PER_LONG + __builtin_ctzl(pending);
+            
+            iter->reset();
+            while ((func = OSDynamicCast(RMIFunction, iter->getNextObject()))) {
+                if (func->hasIRQ(bit))
+                    break;
+            }
+            
+            if (!func) {
+                pending &= pending - 1;
+                continue;
+            }
+            
+            // One attention per function, however many of its sources fired
+            if (func != last) {
+                if (frame.function_count < RMI_SLOW_FRAME_FUNCTIONS)
+                    frame.functions[frame.function_count++] = func->getFunctionNumber();
+                messageClient(kHandleRMIAttention, func, &start);
             }
+            last = func;
+            
+            unsigned int end = func->getIRQPos() + func->getIRQCount() - i * BITS_PER_LONG;
+            if (end >= BITS_PER_LONG)
+                pending = 0;
+            else
+                pending &= ~((1UL << end) - 1);
         }
-        
-        mask &= ~movingMask;
-        iter->reset();
-        movingMask <<= 1;
     }
     
     OSSafeReleaseNULL(iter);
+    checkFrameBudget(&frame, start, status);
+}
+
+/*
+ * Attentions that take longer than FrameBudget are kept in a ring and
+ * published as "Slow Frames", so stutter can be looked into after the fact.
+ * F11/F12 reports are read in the background, checkReportBudget times those
+ */
+void RMIBus::checkFrameBudget(struct rmi_slow_frame *frame, AbsoluteTime start,
+                              AbsoluteTime status)
+{
+    AbsoluteTime end;
+    UInt64 status_ns, total_ns;
+    
+    // Done counting, reads on this thread are on their own again
+    attention_thread = nullptr;
+    attention_frame = nullptr;
+    
+    if (!frame_budget_us)
+        return;
+    
+    clock_get_uptime(&end);
+    absolutetime_to_nanoseconds(end - start, &total_ns);
+    if (total_ns / 1000 <= frame_budget_us)
+        return;
+    
+    absolutetime_to_nanoseconds(status - start, &status_ns);
+    absolutetime_to_nanoseconds(start, &frame->timestamp);
+    frame->status_us = static_cast<UInt32>(status_ns / 1000);
+    frame->dispatch_us = static_cast<UInt32>((total_ns - status_ns) / 1000);
+    
+    recordSlowFrame(frame);
+}
+
+/*
+ * Called on the transport's completion thread once an F11/F12 report read
+ * in the background was parsed. start is when its attention came in
+ */
+void RMIBus::checkReportBudget(u8 function, AbsoluteTime start, const rmi_transfer_stats *stats)
+{
+    struct rmi_slow_frame frame {};
+    AbsoluteTime end;
+    UInt64 total_ns;
+    
+    if (!frame_budget_us)
+        return;
+    
+    clock_get_uptime(&end);
+    absolutetime_to_nanoseconds(end - start, &total_ns);
+    if (total_ns / 1000 <= frame_budget_us)
+        return;
+    
+    absolutetime_to_nanoseconds(start, &frame.timestamp);
+    frame.report_us = static_cast<UInt32>(total_ns / 1000);
+    frame.transactions = stats->transactions;
+    frame.retries = stats->retries;
+    frame.errors = stats->errors;
+    frame.functions[0] = function;
+    frame.function_count = 1;
+    
+    recordSlowFrame(&frame);
+}
+
+void RMIBus::recordSlowFrame(const struct rmi_slow_frame *frame)
+{
+    IOLockLock(slow_frame_lock);
+    slow_frames[slow_frame_count % RMI_SLOW_FRAME_SNAPSHOTS] = *frame;
+    slow_frame_count++;
+    publishSlowFrames();
+    IOLockUnlock(slow_frame_lock);
+}
+
+// Called with slow_frame_lock held
+void RMIBus::publishSlowFrames()
+{
+    UInt32 count = min(slow_frame_count, RMI_SLOW_FRAME_SNAPSHOTS);
+    OSArray *frames = OSArray::withCapacity(count);
+    OSDictionary *entry;
+    OSNumber *value;
+    OSData *functions;
+    
+    if (!frames)
+        return;
+    
+#define SET_VALUE(key, number, bits) \
+    value = OSNumber::withNumber(number, bits); \
+    entry->setObject(key, value); \
+    OSSafeReleaseNULL(value);
+    
+    // Oldest first
+    for (UInt32 i = slow_frame_count - count; i < slow_frame_count; i++) {
+        const struct rmi_slow_frame *frame = &slow_frames[i % RMI_SLOW_FRAME_SNAPSHOTS];
+        
+        entry = OSDictionary::withCapacity(8);
+        if (!entry)
+            break;
+        
+        SET_VALUE("Timestamp", frame->timestamp, 64);
+        SET_VALUE("Status Read", frame->status_us, 32);
+        SET_VALUE("Dispatch", frame->dispatch_us, 32);
+        SET_VALUE("Report", frame->report_us, 32);
+        SET_VALUE("Transactions", frame->transactions, 32);
+        SET_VALUE("Retries", frame->retries, 32);
+        SET_VALUE("Errors", frame->errors, 32);
+        
+        functions = OSData::withBytes(frame->functions, frame->function_count);
+        if (functions) {
+            entry->setObject("Functions", functions);
+            OSSafeReleaseNULL(functions);
+        }
+        
+        frames->setObject(entry);
+        OSSafeReleaseNULL(entry);
+    }
+#undef SET_VALUE
+    
+    setProperty("Slow Frames", frames);
+    setProperty("Slow Frame Count", slow_frame_count, 32);
+    OSSafeReleaseNULL(frames);
 }
 
 void RMIBus::handleHostNotifyLegacy()
@@ -145,9 +313,12 @@ void RMIBus::handleHostNotifyLegacy()
          return;
      }
 
+     AbsoluteTime timestamp;
+     clock_get_uptime(&timestamp);
+
      OSIterator* iter = OSCollectionIterator::withCollection(functions);
      while(RMIFunction *func = OSDynamicCast(RMIFunction, iter->getNextObject()))
-         messageClient(kHandleRMIAttention, func);
+         messageClient(kHandleRMIAttention, func, &timestamp);
      OSSafeReleaseNULL(iter);
  }
 
@@ -155,13 +326,17 @@ IOReturn RMIBus::message(UInt32 type, IOService *provider, void *argument) {
     switch (type) {
         case kIOMessageVoodooI2CHostNotify:
         case kIOMessageVoodooSMBusHostNotify:
-            if (awake)
+            if (awake && !recovering)
                 handleHostNotify();
             return kIOReturnSuccess;
         case kIOMessageVoodooI2CLegacyHostNotify:
-            if (awake)
+            if (awake && !recovering)
                 handleHostNotifyLegacy();
             return kIOReturnSuccess;
+        case kIOMessageRMITransportRecover:
+            if (awake)
+                scheduleRecovery();
+            return kIOReturnSuccess;
         default:
             return super::message(type, provider);
     }
@@ -196,36 +371,106 @@ IOReturn RMIBus::setPowerState(unsigned long whichState, IOService* whatDevice)
     if (whatDevice != this)
         return kIOPMAckImplied;
     
-    if (whichState == 0 && awake) {
+    // Waits for a recovery that is already running
+    if (command_gate)
+        command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &RMIBus::setPowerStateGated), &whichState);
+    else
+        setPowerStateGated(&whichState);
+
+    return kIOPMAckImplied;
+}
+
+void RMIBus::setPowerStateGated(unsigned long *whichState)
+{
+    if (*whichState == 0 && awake) {
         IOLogDebug("Sleep");
+        // Can't fire anymore once cancelled, the timer only runs behind the gate
+        if (recovery_timer) {
+            recovery_timer->cancelTimeout();
+            recovery_pending = 0;
+        }
         messageClients(kHandleRMISuspend);
         rmi_driver_clear_irq_bits(this);
         awake = false;
     } else if (!awake) {
         IOSleep(1000);
         IOLogDebug("Wakeup");
-        if (reset() < 0)
-            IOLogError("Could not get SMBus Version on wakeup\n");
-        // c++ lambdas are wack
-        // Sensor doesn't wake up if we don't scan property tables
-        rmi_scan_pdt(this, NULL, [](RMIBus *rmi_dev,
-                                 void *ctx, const struct pdt_entry *pdt) -> int
-        {
-            IOLogDebug("Function F%X found again", pdt->function_number);
-            return 0;
-        });
-        rmi_driver_set_irq_bits(this);
-        messageClients(kHandleRMIResume);
+        reinitSensor();
         awake = true;
     }
+}
 
-    return kIOPMAckImplied;
+/*
+ * Brings the sensor back after it lost its state, on wake and after reads
+ * kept failing
+ */
+void RMIBus::reinitSensor()
+{
+    if (reset() < 0)
+        IOLogError("Could not get SMBus Version on wakeup\n");
+    // Sensor doesn't wake up if we don't scan property tables
+    if (rmi_validate_topology(this) < 0)
+        IOLogError("Sensor layout doesn't match what was probed\n");
+    rmi_driver_set_irq_bits(this);
+    messageClients(kHandleRMIResume);
+}
+
+/*
+ * Called from whichever thread the reads failed on, so the reset itself
+ * happens later on our own work loop. Recoveries close together back off
+ */
+void RMIBus::scheduleRecovery()
+{
+    AbsoluteTime now;
+    UInt64 elapsed;
+    
+    // One at a time, whatever fails meanwhile is taken care of by the pending one
+    if (!recovery_timer || !OSCompareAndSwap(0, 1, &recovery_pending))
+        return;
+    
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - last_recovery, &elapsed);
+    if (elapsed / 1000000 > 2 * RMI_RECOVERY_MAX_DELAY_MS)
+        recovery_delay_ms = RMI_RECOVERY_DELAY_MS;
+    
+    recovery_timer->setTimeoutMS(recovery_delay_ms);
+    recovery_delay_ms = min(recovery_delay_ms * 2, RMI_RECOVERY_MAX_DELAY_MS);
+}
+
+/*
+ * Runs behind command_gate like setPowerStateGated, so awake can't change
+ * under it
+ */
+void RMIBus::recoverSensor(IOTimerEventSource *sender)
+{
+    if (awake) {
+        IOLog("%s: Reads keep failing, resetting the sensor\n", getName());
+        recovering = true;
+        reinitSensor();
+        recovering = false;
+    }
+    
+    clock_get_uptime(&last_recovery);
+    recovery_pending = 0;
 }
 
 void RMIBus::stop(IOService *provider) {
     OSIterator *iter = OSCollectionIterator::withCollection(functions);
     
     PMstop();
+    
+    // Removing either waits for whatever they're running
+    if (recovery_timer) {
+        recovery_timer->cancelTimeout();
+        work_loop->removeEventSource(recovery_timer);
+        OSSafeReleaseNULL(recovery_timer);
+    }
+    if (command_gate) {
+        work_loop->removeEventSource(command_gate);
+        OSSafeReleaseNULL(command_gate);
+    }
+    OSSafeReleaseNULL(work_loop);
+    
     rmi_driver_clear_irq_bits(this);
     
     while (RMIFunction *func = OSDynamicCast(RMIFunction, iter->getNextObject())) {
@@ -243,10 +488,17 @@ void RMIBus::stop(IOService *provider) {
 void RMIBus::free() {
     if (data) {
         rmi_free_function_list(this);
+        rmi_free_irq_memory(data);
+        rmi_free_topology(data);
         IOLockFree(data->enabled_mutex);
         IOLockFree(data->irq_mutex);
     }
     
+    if (slow_frame_lock) {
+        IOLockFree(slow_frame_lock);
+        slow_frame_lock = nullptr;
+    }
+    
     if (functions)
         OSSafeReleaseNULL(functions);
     super::free();
@@ -324,8 +576,8 @@ int RMIBus::rmi_register_function(rmi_function *fn) {
     desc->query_base_addr = fn->fd.query_base_addr;
     
     function->setFunctionDesc(desc);
-    function->setMask(fn->irq_mask[0]);
     function->setIrqPos(fn->irq_pos);
+    function->setIrqCount(fn->num_of_irqs);
     
     if (!function->attach(this)) {
         IOLogError("Function %02X could not attach\n", fn->fd.function_number);
@@ -13,6 +13,10 @@ class RMIFunction;
 #include <IOKit/IOLib.h>
 #include <IOKit/IOService.h>
 #include <IOKit/IOMessage.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOCommandGate.h>
+#include <kern/thread.h>
 #include "LinuxCompat.h"
 #include "RMITransport.hpp"
 #include "rmi.h"
@@ -25,6 +29,31 @@ class RMIFunction;
 #include <F12.hpp>
 #include <F30.hpp>
 
+#define RMI_SLOW_FRAME_SNAPSHOTS    8
+#define RMI_SLOW_FRAME_FUNCTIONS    4
+
+// Recovering from failed reads backs off from the first to the last delay
+#define RMI_RECOVERY_DELAY_MS       100
+#define RMI_RECOVERY_MAX_DELAY_MS   3200
+
+/*
+ * What an attention that went over FrameBudget spent its time on.
+ * F11/F12 reports are read in the background and get a frame of their own,
+ * with only report_us set.
+ * Counts are only what was issued for this frame, not other threads
+ */
+struct rmi_slow_frame {
+    UInt64 timestamp;       // ns since boot, when the attention came in
+    UInt32 status_us;       // reading the IRQ status from F01
+    UInt32 dispatch_us;     // handing the attention to each function
+    UInt32 report_us;       // the attention up to the report being parsed
+    UInt32 transactions;
+    UInt32 retries;
+    UInt32 errors;
+    u8 function_count;
+    u8 functions[RMI_SLOW_FRAME_FUNCTIONS];
+};
+
 class RMIBus : public IOService {
     OSDeclareDefaultStructors(RMIBus);
     
@@ -42,24 +71,48 @@ public:
     rmi_driver_data *data;
     RMITransport *transport;
     bool awake {true};
+    // Bus transactions issued so far, for counting what probing costs. Bumped from several threads
+    volatile SInt32 transactions {0};
     
     // rmi_read
     inline int read(u16 addr, u8 *buf) {
-        return transport->readBlock(addr, buf, 1);
+        struct rmi_transfer_stats stats;
+        int retval = transport->readRetried(addr, buf, 1, false, &stats);
+        countTransfer(&stats);
+        return retval;
     }
     // rmi_read_block
     inline int readBlock(u16 rmiaddr, u8 *databuff, size_t len) {
-        return transport->readBlock(rmiaddr, databuff, len);
+        struct rmi_transfer_stats stats;
+        int retval = transport->readRetried(rmiaddr, databuff, len, false, &stats);
+        countTransfer(&stats);
+        return retval;
+    }
+    inline int submitRead(u16 rmiaddr, u8 *databuff, size_t len,
+                          OSObject *owner, RMITransferAction action, void *context) {
+        int error = transport->submitTransfer(rmiaddr, databuff, len, false, owner, action, context);
+        // A fallback to readBlock counts there
+        if (!error)
+            OSIncrementAtomic(&transactions);
+        return error;
+    }
+    inline int pinRead(u16 rmiaddr, size_t len) {
+        return transport->pinRead(rmiaddr, len);
     }
     // rmi_write
     inline int write(u16 rmiaddr, u8 *buf) {
-        return transport->blockWrite(rmiaddr, buf, 1);
+        return blockWrite(rmiaddr, buf, 1);
     }
     // rmi_block_write
     inline int blockWrite(u16 rmiaddr, u8 *buf, size_t len) {
-        return transport->blockWrite(rmiaddr, buf, len);
+        int retval = transport->blockWrite(rmiaddr, buf, len);
+        struct rmi_transfer_stats stats = {1, 0, retval < 0};
+        countTransfer(&stats);
+        return retval;
     }
     
+    void checkReportBudget(u8 function, AbsoluteTime start, const rmi_transfer_stats *stats);
+    
     OSSet *functions;
     
     void notify(UInt32 type, unsigned int argument = 0);
@@ -67,8 +120,45 @@ public:
     int reset();
 private:
     OSDictionary *config;
+    
+    UInt32 frame_budget_us {0};
+    // Attentions and background reports finish on different threads
+    IOLock *slow_frame_lock {nullptr};
+    UInt32 slow_frame_count {0};
+    struct rmi_slow_frame slow_frames[RMI_SLOW_FRAME_SNAPSHOTS];
+    // Transfers issued from attention_thread are counted in attention_frame
+    struct rmi_slow_frame *attention_frame {nullptr};
+    thread_t attention_thread {nullptr};
+    void checkFrameBudget(struct rmi_slow_frame *frame, AbsoluteTime start,
+                          AbsoluteTime status);
+    void recordSlowFrame(const struct rmi_slow_frame *frame);
+    void publishSlowFrames();
+    
+    inline void countTransfer(const rmi_transfer_stats *stats) {
+        OSIncrementAtomic(&transactions);
+        if (attention_thread != current_thread())
+            return;
+        attention_frame->transactions += stats->transactions;
+        attention_frame->retries += stats->retries;
+        attention_frame->errors += stats->errors;
+    }
+    
+    // Power changes go through command_gate, so they never overlap a recovery
+    IOWorkLoop *work_loop {nullptr};
+    IOCommandGate *command_gate {nullptr};
+    IOTimerEventSource *recovery_timer {nullptr};
+    UInt32 recovery_delay_ms {RMI_RECOVERY_DELAY_MS};
+    AbsoluteTime last_recovery {0};
+    volatile UInt32 recovery_pending {0};
+    // Attentions are ignored while the sensor is being reset
+    volatile bool recovering {false};
+    
     void handleHostNotify();
     void handleHostNotifyLegacy();
+    void reinitSensor();
+    void scheduleRecovery();
+    void recoverSensor(IOTimerEventSource *sender);
+    void setPowerStateGated(unsigned long *whichState);
 };
     
 #endif /* RMIBus_h */
@@ -8,12 +8,23 @@
  */
 
 #include "RMI_2D_Sensor.hpp"
+#include "RMIBus.hpp"
 
 OSDefineMetaClassAndStructors(RMI2DSensor, IOService)
 #define super IOService
 
 #define MilliToNano 1000000
 
+// Stand-in for a host test: the fixed point width must match the old float math
+constexpr bool widthScaleMatchesFloat() {
+    for (int z = 0; z <= 255; z++) {
+        if (rmi_fixed_mul(z, RMI_WIDTH_SCALE) != (z * 2) / 3)
+            return false;
+    }
+    return true;
+}
+static_assert(widthScaleMatchesFloat(), "RMI_WIDTH_SCALE does not match z / 1.5");
+
 bool RMI2DSensor::init(OSDictionary *dictionary)
 {
     disableWhileTypingTimeout =
@@ -23,11 +34,45 @@ bool RMI2DSensor::init(OSDictionary *dictionary)
     forceTouchEmulation = Configuration::loadBoolConfiguration(dictionary, "ForceTouchEmulation", true);
     minYDiffGesture = Configuration::loadUInt32Configuration(dictionary, "MinYDiffThumbDetection", 200);
     
+    axis_align.swap_axes = Configuration::loadBoolConfiguration(dictionary, "SwapAxes", false);
+    axis_align.flip_x = Configuration::loadBoolConfiguration(dictionary, "FlipX", false);
+    axis_align.flip_y = Configuration::loadBoolConfiguration(dictionary, "FlipY", false);
+    axis_align.clip_x_low = Configuration::loadUInt32Configuration(dictionary, "ClipXLow", 0);
+    axis_align.clip_x_high = Configuration::loadUInt32Configuration(dictionary, "ClipXHigh", 0);
+    axis_align.clip_y_low = Configuration::loadUInt32Configuration(dictionary, "ClipYLow", 0);
+    axis_align.clip_y_high = Configuration::loadUInt32Configuration(dictionary, "ClipYHigh", 0);
+    axis_align.offset_x = Configuration::loadUInt32Configuration(dictionary, "OffsetX", 0);
+    axis_align.offset_y = Configuration::loadUInt32Configuration(dictionary, "OffsetY", 0);
+    // Single byte registers on F11, don't let larger values wrap around
+    axis_align.delta_x_threshold = min(Configuration::loadUInt32Configuration(dictionary, "DeltaXThreshold", 0), 0xff);
+    axis_align.delta_y_threshold = min(Configuration::loadUInt32Configuration(dictionary, "DeltaYThreshold", 0), 0xff);
+    
+    zones.edge_width = Configuration::loadUInt32Configuration(dictionary, "PalmRejectionEdgeWidth", 0);
+    zones.button_height = Configuration::loadUInt32Configuration(dictionary, "PalmRejectionButtonAreaHeight", 0);
+    zones.typing_height = Configuration::loadUInt32Configuration(dictionary, "PalmRejectionTypingAreaHeight", 0);
+    zones.typing_timeout =
+        Configuration::loadUInt64Configuration(dictionary, "PalmRejectionTypingTimeout", 1000) * MilliToNano;
+    
+    nanoseconds_to_absolutetime(Configuration::loadUInt64Configuration(dictionary, "ResampleInterval", 0) * MilliToNano,
+                                &resampler.interval);
+    
     return super::init();
 }
 
 bool RMI2DSensor::start(IOService *provider)
 {
+    RMIFunction *function = OSDynamicCast(RMIFunction, provider);
+    
+    bus = function ? OSDynamicCast(RMIBus, function->getProvider()) : nullptr;
+    if (!bus) {
+        IOLogError("%s Not attached to a function on RMIBus\n", getName());
+        return false;
+    }
+    function_number = function->getFunctionNumber();
+    
+    compileAxisTransform();
+    compileRejectionZones();
+    
     setProperty(VOODOO_INPUT_LOGICAL_MAX_X_KEY, max_x, 16);
     setProperty(VOODOO_INPUT_LOGICAL_MAX_Y_KEY, max_y, 16);
     // Need to be in 0.01mm units
@@ -43,17 +88,77 @@ bool RMI2DSensor::start(IOService *provider)
     freeFingerTypes[kMT2FingerTypeUndefined] = false;
     
     memset(invalidFinger, false, 10);
+    memset(contactZone, 0, sizeof(contactZone));
+    memset(history, 0, sizeof(history));
+    memset(lastObjs, 0, sizeof(lastObjs));
+    lastFingers = 0;
+    
+    work_loop = IOWorkLoop::workLoop();
+    if (!work_loop) {
+        IOLogError("%s Could not create work loop\n", getName());
+        return false;
+    }
+    
+    command_gate = IOCommandGate::commandGate(this);
+    if (!command_gate || (work_loop->addEventSource(command_gate) != kIOReturnSuccess)) {
+        IOLogError("%s Could not open command gate\n", getName());
+        OSSafeReleaseNULL(command_gate);
+        OSSafeReleaseNULL(work_loop);
+        return false;
+    }
+    
+    if (resampler.interval) {
+        resample_timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &RMI2DSensor::resampleTick));
+        if (!resample_timer || (work_loop->addEventSource(resample_timer) != kIOReturnSuccess)) {
+            IOLogError("%s Could not create resample timer, frames go out as they come\n", getName());
+            OSSafeReleaseNULL(resample_timer);
+            resampler.interval = 0;
+        }
+    }
     
     registerService();
     
     return super::start(provider);
 }
 
+void RMI2DSensor::stop(IOService *provider)
+{
+    if (resample_timer) {
+        resample_timer->cancelTimeout();
+        work_loop->removeEventSource(resample_timer);
+        OSSafeReleaseNULL(resample_timer);
+    }
+    
+    if (command_gate) {
+        work_loop->removeEventSource(command_gate);
+        OSSafeReleaseNULL(command_gate);
+    }
+    
+    OSSafeReleaseNULL(work_loop);
+    super::stop(provider);
+}
+
+bool RMI2DSensor::allocRxBuffers()
+{
+    for (int i = 0; i < RMI_2D_RX_BUFFERS; i++) {
+        rx_pkt[i] = reinterpret_cast<u8 *>(IOMalloc(pkt_size));
+        if (!rx_pkt[i])
+            return false;
+    }
+    
+    return true;
+}
+
 void RMI2DSensor::free()
 {
     if (data_pkt)
         IOFree(data_pkt, pkt_size);
     
+    for (int i = 0; i < RMI_2D_RX_BUFFERS; i++) {
+        if (rx_pkt[i])
+            IOFree(rx_pkt[i], pkt_size);
+    }
+    
     return super::free();
 }
 
@@ -75,21 +180,64 @@ void RMI2DSensor::handleClose(IOService *forClient, IOOptionBits options)
     super::handleClose(forClient, options);
 }
 
+/*
+ * Reports come from the transport's thread, F30/F03 state and the keyboard
+ * from elsewhere, so everything is handled under the gate
+ */
 IOReturn RMI2DSensor::message(UInt32 type, IOService *provider, void *argument)
 {
-    switch (type)
+    uint64_t timestamp;
+    
+    if (!command_gate)
+        return kIOReturnNotReady;
+    
+    // Taken now, it may only be applied once the packet being read is out
+    if (type == kHandleRMITrackpoint) {
+        clock_get_uptime(&timestamp);
+        absolutetime_to_nanoseconds(timestamp, &timestamp);
+        argument = &timestamp;
+    }
+    
+    return command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &RMI2DSensor::messageGated),
+                                   &type, argument);
+}
+
+IOReturn RMI2DSensor::messageGated(UInt32 *type, void *argument)
+{
+    // Packet read last, which F30/F03 state from this attention goes after
+    struct rmi_2d_rx_deferred *deferred = rx_pending ?
+        &rx_deferred[(rx_index + RMI_2D_RX_BUFFERS - 1) % RMI_2D_RX_BUFFERS] : nullptr;
+    
+    switch (*type)
     {
-        case kHandleRMIInputReport:
-            handleReport(reinterpret_cast<RMI2DSensorReport *>(argument));
+        case kHandleRMIInputReport: {
+            RMI2DSensorReport *report = reinterpret_cast<RMI2DSensorReport *>(argument);
+            
+            if (shouldDiscardReport(report->timestamp))
+                break;
+            
+            if (resampler.interval)
+                resampleReport(report);
+            else
+                handleReport(report);
             break;
+        }
         case kHandleRMIClickpadSet:
-            clickpadState = !!(argument);
+            if (deferred) {
+                deferred->clickpad_set = true;
+                deferred->clickpad = !!(argument);
+            } else {
+                clickpadState = !!(argument);
+            }
             break;
         case kHandleRMITrackpoint:
             // Re-use keyboard var as it's the same thin
-            uint64_t timestamp;
-            clock_get_uptime(&timestamp);
-            absolutetime_to_nanoseconds(timestamp, &lastKeyboardTS);
+            if (deferred) {
+                deferred->trackpoint = true;
+                deferred->trackpoint_ts = *((uint64_t *) argument);
+            } else {
+                lastKeyboardTS = *((uint64_t *) argument);
+            }
             break;
             
         // VoodooPS2 Messages
@@ -109,12 +257,472 @@ IOReturn RMI2DSensor::message(UInt32 type, IOService *provider, void *argument)
     return kIOReturnSuccess;
 }
 
+/*
+ * Starts reading the packet for an attention into the next rx_pkt.
+ * Returns 0 once it is queued, or dropped because enough are in flight
+ * already. Without a transfer queue it's read into data_pkt right here and
+ * 1 is returned, for the caller to parse right away.
+ * action is called with the slot as context, and passes it on to
+ * takeReport and readCompleted
+ */
+int RMI2DSensor::readReport(u16 addr, AbsoluteTime timestamp, IOService *owner, RMITransferAction action)
+{
+    int slot, error;
+    
+    // Packets hold every object, so a newer one makes up for a dropped one
+    if (rx_pending >= RMI_2D_RX_BUFFERS) {
+        IOLogDebug("%s - Still reading the last packets, dropping this one\n",
+                   owner->getName());
+        return 0;
+    }
+    
+    slot = rx_index;
+    rx_timestamp[slot] = timestamp;
+    OSIncrementAtomic(&rx_pending);
+    error = bus->submitRead(addr, rx_pkt[slot], pkt_size, owner, action, (void *) (uintptr_t) slot);
+    if (!error) {
+        rx_index = (rx_index + 1) % RMI_2D_RX_BUFFERS;
+        return 0;
+    }
+    
+    OSDecrementAtomic(&rx_pending);
+    if (error != -ENODEV || rx_pending)
+        return error;
+    
+    // No transfer queue, read it here
+    error = bus->readBlock(addr, data_pkt, pkt_size);
+    if (error < 0) {
+        IOLogError("%s - Could not read attention data: %d\n",
+                   owner->getName(), error);
+        return error;
+    }
+    
+    return 1;
+}
+
+/*
+ * Moves a packet read in the background into data_pkt. Returns false if
+ * there is nothing to parse. Either way readCompleted has to follow
+ */
+bool RMI2DSensor::takeReport(IOService *owner, void *context, int result, AbsoluteTime *timestamp)
+{
+    int slot = (int) (uintptr_t) context;
+    
+    if (result < 0) {
+        if (result != -ECANCELED)
+            IOLogError("%s - Could not read attention data: %d\n",
+                       owner->getName(), result);
+        return false;
+    }
+    
+    memcpy(data_pkt, rx_pkt[slot], pkt_size);
+    *timestamp = rx_timestamp[slot];
+    return true;
+}
+
+/*
+ * Called by F11/F12 once the packet in rx_pkt[slot] was handed over,
+ * or couldn't be read. The frame counts against the bus's FrameBudget
+ * from the attention up to here
+ */
+void RMI2DSensor::readCompleted(void *context, int result, const rmi_transfer_stats *stats)
+{
+    int slot = (int) (uintptr_t) context;
+    
+    // The slot is up for grabs again once rx_pending drops
+    if (result != -ECANCELED)
+        bus->checkReportBudget(function_number, rx_timestamp[slot], stats);
+    
+    if (command_gate)
+        command_gate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &RMI2DSensor::readCompletedGated), &slot);
+    else
+        OSDecrementAtomic(&rx_pending);
+}
+
+void RMI2DSensor::readCompletedGated(int *slot)
+{
+    struct rmi_2d_rx_deferred *deferred = &rx_deferred[*slot];
+    
+    if (deferred->clickpad_set)
+        clickpadState = deferred->clickpad;
+    if (deferred->trackpoint)
+        lastKeyboardTS = deferred->trackpoint_ts;
+    
+    memset(deferred, 0, sizeof(*deferred));
+    OSDecrementAtomic(&rx_pending);
+}
+
 bool RMI2DSensor::shouldDiscardReport(AbsoluteTime timestamp)
 {
     return  !touchpadEnable ||
             (timestamp - lastKeyboardTS) < disableWhileTypingTimeout;
 }
 
+/*
+ * Based off of rmi_2d_sensor_abs_process and rmi_2d_sensor_set_input_params.
+ * The alignment is applied in the order flip -> swap -> offset -> clip.
+ * max_x/max_y (and the physical size) are rewritten to describe the aligned
+ * output, so everything past the decoders only ever sees aligned coordinates.
+ */
+void RMI2DSensor::compileAxisTransform()
+{
+    int sign_x = axis_align.flip_x ? -1 : 1;
+    int sign_y = axis_align.flip_y ? -1 : 1;
+    int base_x = axis_align.flip_x ? max_x : 0;
+    int base_y = axis_align.flip_y ? max_y : 0;
+    
+    if (axis_align.swap_axes) {
+        transform.xx = 0;
+        transform.xy = sign_y;
+        transform.x0 = base_y;
+        transform.yx = sign_x;
+        transform.yy = 0;
+        transform.y0 = base_x;
+        
+        u16 temp = max_x;
+        max_x = max_y;
+        max_y = temp;
+        
+        u8 temp_mm = x_mm;
+        x_mm = y_mm;
+        y_mm = temp_mm;
+    } else {
+        transform.xx = sign_x;
+        transform.xy = 0;
+        transform.x0 = base_x;
+        transform.yx = 0;
+        transform.yy = sign_y;
+        transform.y0 = base_y;
+    }
+    
+    transform.x0 += axis_align.offset_x;
+    transform.y0 += axis_align.offset_y;
+    
+    transform.min_x = axis_align.clip_x_low;
+    transform.min_y = axis_align.clip_y_low;
+    transform.max_x = axis_align.clip_x_high ? imin(axis_align.clip_x_high, max_x) : max_x;
+    transform.max_y = axis_align.clip_y_high ? imin(axis_align.clip_y_high, max_y) : max_y;
+    
+    min_x = transform.min_x;
+    min_y = transform.min_y;
+    max_x = transform.max_x;
+    max_y = transform.max_y;
+    
+    IOLogDebug("Axis transform: x = %d * x + %d * y + %d [%d, %d], y = %d * x + %d * y + %d [%d, %d]",
+               transform.xx, transform.xy, transform.x0, transform.min_x, transform.max_x,
+               transform.yx, transform.yy, transform.y0, transform.min_y, transform.max_y);
+}
+
+/*
+ * Zones are only resolved to grid cells here, so checking a contact later is
+ * one multiply-shift per axis and a table read. Zone edges are rounded up to
+ * whole cells (about 3% of the sensor each).
+ * y grows upwards in sensor space: the button area is at low y, and the
+ * area next to the keyboard at high y.
+ */
+void RMI2DSensor::compileRejectionZones()
+{
+    int edgeCells = DIV_ROUND_UP(imin(zones.edge_width, 50) * RMI_ZONE_GRID_SIZE, 100);
+    int buttonCells = DIV_ROUND_UP(imin(zones.button_height, 100) * RMI_ZONE_GRID_SIZE, 100);
+    int typingCells = DIV_ROUND_UP(imin(zones.typing_height, 100) * RMI_ZONE_GRID_SIZE, 100);
+    
+    zonesEnabled = edgeCells || buttonCells || typingCells;
+    
+    // Maps [0, max] onto [0, RMI_ZONE_GRID_SIZE - 1]. Rounded down, so the
+    // last coordinate can never land past the last cell
+    zoneScaleX = (RMI_ZONE_GRID_SIZE * RMI_FIXED_ONE) / (max_x + 1);
+    zoneScaleY = (RMI_ZONE_GRID_SIZE * RMI_FIXED_ONE) / (max_y + 1);
+    
+    for (int cy = 0; cy < RMI_ZONE_GRID_SIZE; cy++) {
+        for (int cx = 0; cx < RMI_ZONE_GRID_SIZE; cx++) {
+            u8 zone = 0;
+            
+            if (cx < edgeCells || cx >= RMI_ZONE_GRID_SIZE - edgeCells)
+                zone |= RMI_ZONE_EDGE;
+            if (cy < buttonCells)
+                zone |= RMI_ZONE_BUTTON;
+            if (cy >= RMI_ZONE_GRID_SIZE - typingCells)
+                zone |= RMI_ZONE_TYPING;
+            
+            zoneGrid[cy][cx] = zone;
+        }
+    }
+    
+    IOLogDebug("Rejection zones: edge %d, button %d, typing %d cells of %d",
+               edgeCells, buttonCells, typingCells, RMI_ZONE_GRID_SIZE);
+}
+
+/*
+ * A contact's zone is latched when it lands, so a palm that starts on the
+ * edge stays rejected even once it rolls into the middle of the pad.
+ * Edge and typing contacts are dropped until they lift. Contacts resting
+ * in the button area are only dropped while a finger outside of it is
+ * moving, so clicking with a single finger still works.
+ */
+void RMI2DSensor::updateRejectionZones(RMI2DSensorReport *report)
+{
+    int movingContacts = 0;
+    u8 activeZones = RMI_ZONE_EDGE | RMI_ZONE_BUTTON;
+    
+    if ((report->timestamp - lastKeyboardTS) < zones.typing_timeout)
+        activeZones |= RMI_ZONE_TYPING;
+    
+    for (int i = 0; i < report->fingers; i++) {
+        rmi_2d_sensor_abs_object *obj = &report->objs[i];
+        
+        if (obj->type != RMI_2D_OBJECT_FINGER &&
+            obj->type != RMI_2D_OBJECT_STYLUS) {
+            contactZone[i] = 0;
+            continue;
+        }
+        
+        if (!(contactZone[i] & RMI_ZONE_TRACKED))
+            contactZone[i] = RMI_ZONE_TRACKED | (lookupZone(obj->x, obj->y) & activeZones);
+        
+        if (contactZone[i] & ~RMI_ZONE_TRACKED)
+            continue;
+        
+        // History only holds earlier frames here, a new contact reads as still
+        int vx, vy;
+        estimateVelocity(i, &vx, &vy);
+        if (abs(vx) > RMI_ZONE_MOVING || abs(vy) > RMI_ZONE_MOVING)
+            movingContacts++;
+    }
+    
+    for (int i = 0; i < report->fingers; i++) {
+        invalidFinger[i] = (contactZone[i] & (RMI_ZONE_EDGE | RMI_ZONE_TYPING)) ||
+                           ((contactZone[i] & RMI_ZONE_BUTTON) && movingContacts);
+    }
+}
+
+/*
+ * Software version of the F11 delta thresholds. A frame is dropped when
+ * it has the same objects as the last frame sent to VoodooInput, and
+ * none of them moved further than the threshold on either axis or changed
+ * pressure.
+ * Movement is compared to the last frame sent rather than the last frame
+ * received, so slow movement still builds up and gets through.
+ */
+bool RMI2DSensor::isBelowDeltaThreshold(RMI2DSensorReport *report)
+{
+    if (!axis_align.delta_x_threshold && !axis_align.delta_y_threshold)
+        return false;
+    
+    // Never hold back button state changes
+    if (clickpadState || report->fingers != lastFingers)
+        return false;
+    
+    for (int i = 0; i < report->fingers; i++) {
+        rmi_2d_sensor_abs_object *obj = &report->objs[i];
+        rmi_2d_sensor_abs_object *last = &lastObjs[i];
+        
+        if (obj->type != last->type)
+            return false;
+        
+        if (obj->type == RMI_2D_OBJECT_NONE)
+            continue;
+        
+        int dx = obj->x - last->x;
+        int dy = obj->y - last->y;
+        
+        if (abs(dx) > axis_align.delta_x_threshold ||
+            abs(dy) > axis_align.delta_y_threshold ||
+            obj->z != last->z)
+            return false;
+    }
+    
+    return true;
+}
+
+/*
+ * The sensor keeps reporting for a while after every finger has lifted.
+ * The first empty frame goes out so VoodooInput sees the lift, everything
+ * after that is dropped until a contact (or the button) shows up again.
+ */
+static bool reportHasContact(RMI2DSensorReport *report)
+{
+    for (int i = 0; i < report->fingers; i++) {
+        if (report->objs[i].type == RMI_2D_OBJECT_FINGER ||
+            report->objs[i].type == RMI_2D_OBJECT_STYLUS)
+            return true;
+    }
+    
+    return false;
+}
+
+bool RMI2DSensor::isRedundantEmptyFrame(RMI2DSensorReport *report)
+{
+    bool hasContact = clickpadState || reportHasContact(report);
+    
+    if (hasContact) {
+        if (liftSent) {
+            liftSent = false;
+            setProperty("Suppressed Empty Frames", emptyFramesSuppressed, 32);
+        }
+        return false;
+    }
+    
+    if (liftSent) {
+        emptyFramesSuppressed++;
+        return true;
+    }
+    
+    liftSent = true;
+    if (resampler.interval)
+        publishResamplerStats();
+    
+    return false;
+}
+
+/*
+ * State at the given time, interpolated between the last two input frames.
+ * Both always have the same objects, any change restarts the resampler.
+ */
+void RMI2DSensor::interpolateReport(uint64_t time, RMI2DSensorReport *out)
+{
+    RMI2DSensorReport *from = &resampler.prev;
+    RMI2DSensorReport *to = &resampler.last;
+    
+    if (time <= from->timestamp || to->timestamp <= from->timestamp) {
+        *out = time <= from->timestamp ? *from : *to;
+        return;
+    }
+    
+    *out = *to;
+    if (time >= to->timestamp)
+        return;
+    
+    rmi_fixed frac = (rmi_fixed) (((time - from->timestamp) << RMI_FIXED_SHIFT) /
+                                  (to->timestamp - from->timestamp));
+    
+    for (int i = 0; i < to->fingers; i++) {
+        rmi_2d_sensor_abs_object *a = &from->objs[i];
+        rmi_2d_sensor_abs_object *b = &to->objs[i];
+        
+        out->objs[i].x = a->x + rmi_fixed_mul(b->x - a->x, frac);
+        out->objs[i].y = a->y + rmi_fixed_mul(b->y - a->y, frac);
+        out->objs[i].z = a->z + rmi_fixed_mul(b->z - a->z, frac);
+    }
+}
+
+/*
+ * Input frames are not sent as they come in. They are kept, and
+ * resampleTick sends a frame on every grid point, showing where contacts
+ * were one interval earlier. That adds about one interval of latency.
+ * Touch down, lift off and long gaps aren't interpolated at all,
+ * they go out right away and the grid restarts with the next frame
+ * that has a contact.
+ */
+#define RMI_RESAMPLE_MAX_GAP    4
+
+void RMI2DSensor::resampleReport(RMI2DSensorReport *report)
+{
+    rmi_2d_resampler *rs = &resampler;
+    uint64_t now = report->timestamp;
+    bool changed = !rs->has_last || report->fingers != rs->last.fingers;
+    
+    rs->frames_in++;
+    
+    if (rs->has_last) {
+        uint64_t delta = now - rs->last.timestamp;
+        uint64_t jitter = delta > rs->last_delta ? delta - rs->last_delta : rs->last_delta - delta;
+        
+        if (delta > rs->interval * RMI_RESAMPLE_MAX_GAP) {
+            // Idle gap between gestures, not jitter
+            changed = true;
+            delta = 0;
+        } else if (rs->last_delta) {
+            rs->jitter_samples++;
+            rs->total_jitter += jitter;
+            if (jitter > rs->max_jitter)
+                rs->max_jitter = jitter;
+        }
+        rs->last_delta = delta;
+    }
+    
+    for (int i = 0; i < report->fingers && !changed; i++)
+        changed = report->objs[i].type != rs->last.objs[i].type;
+    
+    // Nothing to interpolate once every finger is up. The sensor keeps
+    // reporting for a while, so the timer stays off until a contact is back
+    if (changed || !reportHasContact(report)) {
+        resample_timer->cancelTimeout();
+        rs->running = false;
+        rs->prev = rs->last = *report;
+        rs->has_last = true;
+        rs->frames_out++;
+        handleReport(report);
+        return;
+    }
+    
+    rs->prev = rs->last;
+    rs->last = *report;
+    memset(report, 0, sizeof(RMI2DSensorReport));
+    
+    if (!rs->running) {
+        rs->running = true;
+        rs->next = now + rs->interval;
+        resample_timer->wakeAtTime(rs->next);
+    }
+}
+
+void RMI2DSensor::resampleTick(IOTimerEventSource *sender)
+{
+    rmi_2d_resampler *rs = &resampler;
+    RMI2DSensorReport out;
+    uint64_t now;
+    
+    if (!rs->running)
+        return;
+    
+    // Input stopped, wait for it rather than repeating the last frame
+    if (rs->next - rs->last.timestamp > rs->interval * RMI_RESAMPLE_MAX_GAP) {
+        rs->running = false;
+        return;
+    }
+    
+    interpolateReport(rs->next - rs->interval, &out);
+    out.timestamp = rs->next;
+    rs->frames_out++;
+    handleReport(&out);
+    
+    // Skip grid points that were missed rather than sending them in a burst
+    clock_get_uptime(&now);
+    do {
+        rs->next += rs->interval;
+    } while (rs->next <= now);
+    
+    resample_timer->wakeAtTime(rs->next);
+}
+
+void RMI2DSensor::publishResamplerStats()
+{
+    uint64_t jitter;
+    OSDictionary *stats = OSDictionary::withCapacity(4);
+    if (!stats)
+        return;
+    
+    OSNumber *value = OSNumber::withNumber(resampler.frames_in, 32);
+    stats->setObject("Frames In", value);
+    OSSafeReleaseNULL(value);
+    value = OSNumber::withNumber(resampler.frames_out, 32);
+    stats->setObject("Frames Out", value);
+    OSSafeReleaseNULL(value);
+    // Jitter in microseconds
+    absolutetime_to_nanoseconds(resampler.max_jitter, &jitter);
+    value = OSNumber::withNumber(jitter / 1000, 64);
+    stats->setObject("Max Jitter", value);
+    OSSafeReleaseNULL(value);
+    absolutetime_to_nanoseconds(resampler.jitter_samples ?
+                                resampler.total_jitter / resampler.jitter_samples : 0, &jitter);
+    value = OSNumber::withNumber(jitter / 1000, 64);
+    stats->setObject("Mean Jitter", value);
+    OSSafeReleaseNULL(value);
+    
+    setProperty("Resampler", stats);
+    OSSafeReleaseNULL(stats);
+}
+
 void RMI2DSensor::handleReport(RMI2DSensorReport *report)
 {
     int realFingerCount = 0;
@@ -122,6 +730,17 @@ void RMI2DSensor::handleReport(RMI2DSensorReport *report)
     if (!voodooInputInstance)
         return;
     
+    if (isRedundantEmptyFrame(report) || isBelowDeltaThreshold(report)) {
+        memset(report, 0, sizeof(RMI2DSensorReport));
+        return;
+    }
+    
+    lastFingers = report->fingers;
+    memcpy(lastObjs, report->objs, sizeof(lastObjs));
+    
+    if (zonesEnabled)
+        updateRejectionZones(report);
+    
     for (int i = 0; i < report->fingers; i++) {
         rmi_2d_sensor_abs_object obj = report->objs[i];
         
@@ -137,11 +756,12 @@ void RMI2DSensor::handleReport(RMI2DSensorReport *report)
         
         if (isValid) {
             realFingerCount++;
+            recordHistory(i, &obj);
             
-            // Dissallow large objects
-            transducer.isValid = obj.z < 120 && obj.wx < 7 && obj.wy < 7;
+            // Dissallow large objects and anything in a rejection zone
+            transducer.isValid = obj.z < 120 && obj.wx < 7 && obj.wy < 7 && !invalidFinger[i];
             transducer.previousCoordinates = transducer.currentCoordinates;
-            transducer.currentCoordinates.width = obj.z / 1.5;
+            transducer.currentCoordinates.width = rmi_fixed_mul(obj.z, RMI_WIDTH_SCALE);
             transducer.timestamp = report->timestamp;
             
             if (realFingerCount != 1)
@@ -166,11 +786,13 @@ void RMI2DSensor::handleReport(RMI2DSensorReport *report)
                        transducer.fingerType,
                        transducer.currentCoordinates.pressure,
                        transducer.isPhysicalButtonDown);
+        } else if (history[i].count) {
+            resetHistory(i);
         }
     }
     
-    if (realFingerCount == 4 && freeFingerTypes[kMT2FingerTypeThumb]) {
-        setThumbFingerType(report->fingers, report);
+    if (realFingerCount == 4) {
+        classifyThumb(report->fingers);
     }
     
     // Sencond loop to get type
@@ -204,51 +826,154 @@ void RMI2DSensor::handleReport(RMI2DSensorReport *report)
     memset(report, 0, sizeof(RMI2DSensorReport));
 }
 
-void RMI2DSensor::setThumbFingerType(int fingers, RMI2DSensorReport *report)
+void RMI2DSensor::recordHistory(int slot, rmi_2d_sensor_abs_object *obj)
+{
+    rmi_2d_contact_history *hist = &history[slot];
+    rmi_2d_sensor_abs_object *sample = &hist->samples[hist->head];
+    
+    if (hist->count == RMI_HISTORY_SIZE) {
+        // Oldest sample is about to be overwritten
+        hist->sum_y -= sample->y;
+        hist->sum_z -= sample->z;
+    } else {
+        hist->count++;
+    }
+    
+    *sample = *obj;
+    hist->sum_y += obj->y;
+    hist->sum_z += obj->z;
+    hist->head = (hist->head + 1) % RMI_HISTORY_SIZE;
+}
+
+void RMI2DSensor::resetHistory(int slot)
+{
+    memset(&history[slot], 0, sizeof(rmi_2d_contact_history));
+    
+    if (slot == thumbSlot)
+        thumbSlot = -1;
+    if (slot == thumbChallenger) {
+        thumbChallenger = -1;
+        thumbChallengerFrames = 0;
+    }
+}
+
+/*
+ * Average movement per frame over the history window, in sensor units
+ */
+void RMI2DSensor::estimateVelocity(int slot, int *vx, int *vy)
+{
+    rmi_2d_contact_history *hist = &history[slot];
+    
+    *vx = *vy = 0;
+    if (hist->count < 2)
+        return;
+    
+    int newest = (hist->head + RMI_HISTORY_SIZE - 1) % RMI_HISTORY_SIZE;
+    int oldest = (hist->head + RMI_HISTORY_SIZE - hist->count) % RMI_HISTORY_SIZE;
+    
+    *vx = (hist->samples[newest].x - hist->samples[oldest].x) / (hist->count - 1);
+    *vy = (hist->samples[newest].y - hist->samples[oldest].y) / (hist->count - 1);
+}
+
+/*
+ * Same rules as before, but on averaged history rather than the current
+ * frame: take the lowest contact if it is clearly below the rest,
+ * otherwise the one with the greatest area.
+ * y grows upwards in sensor space, so the lowest contact has the smallest y.
+ */
+int RMI2DSensor::pickThumbCandidate(int fingers)
 {
-    int lowestFingerIndex = -1;
-    int greatestFingerIndex = -1;
-    UInt32 minY = 0, secondLowest = 0;
-    UInt32 maxDiff = 0;
-    UInt32 maxArea = 0;
+    int lowestIndex = -1;
+    int greatestIndex = -1;
+    // Above any u16 coordinate
+    const int none = 0x10000;
+    int minY = none, secondLowest = none;
+    int maxArea = -1;
     
     for (int i = 0; i < fingers; i++) {
-        auto &trans = inputEvent.transducers[i];
-        rmi_2d_sensor_abs_object *obj = &report->objs[i];
+        rmi_2d_contact_history *hist = &history[i];
         
-        if (!trans.isValid)
+        if (!inputEvent.transducers[i].isValid || !hist->count)
             continue;
         
-        // Take the most obvious lowest finger - otherwise take finger with greatest area
-        if (trans.currentCoordinates.y > minY) {
-            lowestFingerIndex = i;
-            secondLowest = minY;
-            minY = trans.currentCoordinates.y;
-        }
+        int avgY = hist->sum_y / hist->count;
+        int avgZ = hist->sum_z / hist->count;
         
-        if (trans.currentCoordinates.y > secondLowest && trans.currentCoordinates.y < minY) {
-            secondLowest = trans.currentCoordinates.y;
+        if (avgY < minY) {
+            lowestIndex = i;
+            secondLowest = minY;
+            minY = avgY;
+        } else if (avgY < secondLowest) {
+            secondLowest = avgY;
         }
         
-        if (/*(obj->wy - obj->wx) > maxDiff ||*/ obj->z > maxArea) {
-            maxDiff = (obj->wy - obj->wx);
-            maxArea = obj->z;
-            greatestFingerIndex = i;
+        if (avgZ > maxArea) {
+            maxArea = avgZ;
+            greatestIndex = i;
         }
     }
     
-    if (minY - secondLowest < minYDiffGesture || greatestFingerIndex == -1) {
-//        IOLogDebug("Second Lowest: %u Lowest: %u\n", secondLowest, minY);
-        
-        lowestFingerIndex = greatestFingerIndex;
+    if (secondLowest == none || secondLowest - minY < (int) minYDiffGesture)
+        return greatestIndex;
+    
+    return lowestIndex;
+}
+
+/*
+ * The thumb only moves to another contact once that contact has been the
+ * better candidate for RMI_THUMB_HYSTERESIS frames in a row, which keeps the
+ * finger types (and so VoodooInput's gesture state) steady mid-gesture.
+ * While the current thumb is moving it takes twice as long to give it up.
+ */
+#define RMI_THUMB_HYSTERESIS    4
+#define RMI_THUMB_MOVING        8
+
+void RMI2DSensor::classifyThumb(int fingers)
+{
+    int candidate = pickThumbCandidate(fingers);
+    
+    if (candidate == -1) {
+        IOLogError("No thumb candidate when there are 4+ fingers");
+        return;
     }
     
-    if (lowestFingerIndex == -1) {
-        IOLogError("LowestFingerIndex = -1 When there are 4+ fingers");
+    if (candidate == thumbSlot) {
+        thumbChallenger = -1;
+        thumbChallengerFrames = 0;
         return;
     }
     
-    auto &trans = inputEvent.transducers[lowestFingerIndex];
+    // Thumb was rejected (or became a palm) since
+    if (thumbSlot != -1 && !inputEvent.transducers[thumbSlot].isValid) {
+        inputEvent.transducers[thumbSlot].fingerType = kMT2FingerTypeUndefined;
+        thumbSlot = -1;
+    }
+    
+    if (thumbSlot != -1) {
+        int vx, vy;
+        estimateVelocity(thumbSlot, &vx, &vy);
+        
+        int needed = RMI_THUMB_HYSTERESIS;
+        if (abs(vx) > RMI_THUMB_MOVING || abs(vy) > RMI_THUMB_MOVING)
+            needed *= 2;
+        
+        if (candidate != thumbChallenger) {
+            thumbChallenger = candidate;
+            thumbChallengerFrames = 0;
+        }
+        
+        if (++thumbChallengerFrames < needed)
+            return;
+        
+        // Hand the old thumb a regular finger type in the next loop
+        inputEvent.transducers[thumbSlot].fingerType = kMT2FingerTypeUndefined;
+    }
+    
+    thumbChallenger = -1;
+    thumbChallengerFrames = 0;
+    thumbSlot = candidate;
+    
+    auto &trans = inputEvent.transducers[thumbSlot];
     if (trans.fingerType != kMT2FingerTypeUndefined)
         freeFingerTypes[trans.fingerType] = true;
     
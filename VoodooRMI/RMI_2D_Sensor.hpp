@@ -11,9 +11,13 @@
 #define RMI_2D_Sensor_hpp
 
 #include <IOKit/IOService.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOTimerEventSource.h>
 #include "Utility/LinuxCompat.h"
 #include "Utility/Configuration.hpp"
 #include "rmi.h"
+#include "Transports/RMITransport.hpp"
 #include "VoodooInputMultitouch/VoodooInputTransducer.h"
 #include "VoodooInputMultitouch/VoodooInputMessages.h"
 
@@ -40,10 +44,113 @@ struct RMI2DSensorReport {
     AbsoluteTime timestamp;
 };
 
-//struct rmi_2d_sensor {
-//    struct rmi_2d_axis_alignment axis_align;
-//    int dmax;
-//};
+// Packets that can be in flight at once, the next read starts while the last is parsed
+#define RMI_2D_RX_BUFFERS   2
+
+class RMIBus;
+
+// Clickpad and trackpoint changes that came in while a packet was read, applied after it
+struct rmi_2d_rx_deferred {
+    bool clickpad_set;
+    bool clickpad;
+    bool trackpoint;
+    uint64_t trackpoint_ts;
+};
+
+/*
+ * Q16.16 fixed point used for all scaling in the sensor path, so nothing
+ * in the interrupt path touches the FPU.
+ * Ratios are built at compile time with RMI_FIXED_RATIO, rounded to
+ * nearest so that rmi_fixed_mul truncates the same way integer division
+ * of the exact ratio would, for any input that fits in 16 bits.
+ */
+typedef s32 rmi_fixed;
+
+#define RMI_FIXED_SHIFT     16
+#define RMI_FIXED_ONE       ((rmi_fixed) 1 << RMI_FIXED_SHIFT)
+
+constexpr rmi_fixed RMI_FIXED_RATIO(s64 num, s64 den) {
+    return (rmi_fixed) (((num << RMI_FIXED_SHIFT) + den / 2) / den);
+}
+
+constexpr int rmi_fixed_mul(int value, rmi_fixed scale) {
+    return (int) (((s64) value * scale) >> RMI_FIXED_SHIFT);
+}
+
+// Contact width reported to VoodooInput, from the sensor's z (was z / 1.5)
+#define RMI_WIDTH_SCALE     RMI_FIXED_RATIO(2, 3)
+
+/*
+ * rmi_2d_axis_alignment compiled down to an integer affine map, so that
+ * flip/swap/offset/clip cost a couple of multiply-adds and clamps per object
+ *
+ * out_x = clamp(xx * x + xy * y + x0, min_x, max_x)
+ * out_y = clamp(yx * x + yy * y + y0, min_y, max_y)
+ */
+struct rmi_2d_axis_transform {
+    int xx, xy, x0;
+    int yx, yy, y0;
+    int min_x, max_x;
+    int min_y, max_y;
+};
+
+/*
+ * Palm rejection zones, looked up from a coarse grid over the aligned sensor
+ * area. Each cell holds the RMI_ZONE_* bits that cover it.
+ */
+#define RMI_ZONE_GRID_SIZE  32
+
+#define RMI_ZONE_EDGE       0x01
+#define RMI_ZONE_BUTTON     0x02
+#define RMI_ZONE_TYPING     0x04
+// Slot has a contact whose zone was latched at touchdown
+#define RMI_ZONE_TRACKED    0x80
+// Sensor units per frame a finger outside the zones has to move before
+// contacts in the button area are dropped
+#define RMI_ZONE_MOVING     4
+
+struct rmi_2d_rejection_zones {
+    // Zone sizes in percent of the sensor size
+    u8 edge_width;
+    u8 button_height;
+    u8 typing_height;
+    uint64_t typing_timeout;
+};
+
+/*
+ * Last few samples of each contact. Running sums are kept as samples come
+ * in and drop out, so averages never need a walk over the ring.
+ */
+#define RMI_HISTORY_SIZE    8
+
+struct rmi_2d_contact_history {
+    rmi_2d_sensor_abs_object samples[RMI_HISTORY_SIZE];
+    u8 head;
+    u8 count;
+    int sum_y;
+    int sum_z;
+};
+
+/*
+ * Resampler state. Frames are emitted by a timer on a fixed grid,
+ * interpolated between the last two input frames. Times are AbsoluteTime.
+ * Jitter is the change in input frame interval from one frame to the next.
+ */
+struct rmi_2d_resampler {
+    uint64_t interval;
+    uint64_t next;
+    RMI2DSensorReport prev;
+    RMI2DSensorReport last;
+    bool has_last;
+    bool running;
+    
+    u32 frames_in;
+    u32 frames_out;
+    u32 jitter_samples;
+    uint64_t last_delta;
+    uint64_t max_jitter;
+    uint64_t total_jitter;
+};
 
 /**
  * @axis_align - controls parameters that are useful in system prototyping
@@ -53,6 +160,8 @@ struct RMI2DSensorReport {
  * @nbr_fingers - How many fingers can this sensor report?
  * @data_pkt - buffer for data reported by this sensor.
  * @pkt_size - number of bytes in that buffer.
+ * @rx_pkt - packets being read in the background, copied into data_pkt once read.
+ * @rx_timestamp - when the attention for each of those packets came in.
  * @attn_size - Size of the HID attention report (only contains abs data).
  * position when two fingers are on the device.  When this is true, we
  * assume we have one of those sensors and report events appropriately..
@@ -71,21 +180,71 @@ public:
     int pkt_size;
     int attn_size;
     
+    u8 *rx_pkt[RMI_2D_RX_BUFFERS] {};
+    AbsoluteTime rx_timestamp[RMI_2D_RX_BUFFERS] {};
+    u8 rx_index {0};
+    volatile SInt32 rx_pending {0};
+    bool allocRxBuffers();
+    int readReport(u16 addr, AbsoluteTime timestamp, IOService *owner, RMITransferAction action);
+    bool takeReport(IOService *owner, void *context, int result, AbsoluteTime *timestamp);
+    void readCompleted(void *context, int result, const rmi_transfer_stats *stats);
+    
     u8 report_abs {0};
     u8 report_rel {0};
     
     u8 nbr_fingers;
     
+    struct rmi_2d_axis_alignment axis_align {};
+    
     bool init(OSDictionary *dictionary) override;
     bool start(IOService *provider) override;
+    void stop(IOService *provider) override;
     bool handleOpen(IOService *forClient, IOOptionBits options, void *arg) override;
     void handleClose(IOService *forClient, IOOptionBits options) override;
     IOReturn message(UInt32 type, IOService *provider, void *argument = 0) override;
     void free() override;
     
-    bool shouldDiscardReport(AbsoluteTime timestamp);
+    /*
+     * Called by F11/F12 for each object while decoding, coordinates
+     * are in the aligned space from then on
+     */
+    inline void alignObject(rmi_2d_sensor_abs_object *obj) {
+        int x = obj->x, y = obj->y;
+        
+        obj->x = imin(imax(transform.xx * x + transform.xy * y + transform.x0,
+                           transform.min_x), transform.max_x);
+        obj->y = imin(imax(transform.yx * x + transform.yy * y + transform.y0,
+                           transform.min_y), transform.max_y);
+    }
 private:
     int lastFingers;
+    rmi_2d_sensor_abs_object lastObjs[10];
+    struct rmi_2d_axis_transform transform {1, 0, 0, 0, 1, 0, 0, 0xFFFF, 0, 0xFFFF};
+    
+    struct rmi_2d_rejection_zones zones {};
+    bool zonesEnabled {false};
+    rmi_fixed zoneScaleX, zoneScaleY;
+    u8 zoneGrid[RMI_ZONE_GRID_SIZE][RMI_ZONE_GRID_SIZE];
+    u8 contactZone[10];
+    
+    struct rmi_2d_contact_history history[10];
+    int thumbSlot {-1};
+    int thumbChallenger {-1};
+    int thumbChallengerFrames {0};
+    
+    struct rmi_2d_resampler resampler {};
+    struct rmi_2d_rx_deferred rx_deferred[RMI_2D_RX_BUFFERS] {};
+    
+    // Bus and function number of the F11/F12 this sensor belongs to
+    RMIBus *bus {nullptr};
+    u8 function_number {0};
+    
+    IOWorkLoop *work_loop {nullptr};
+    IOCommandGate *command_gate {nullptr};
+    IOTimerEventSource *resample_timer {nullptr};
+    
+    bool liftSent {false};
+    u32 emptyFramesSuppressed {0};
     
     VoodooInputEvent inputEvent {};
     IOService *voodooInputInstance {nullptr};
@@ -101,8 +260,28 @@ private:
     
     uint64_t disableWhileTypingTimeout, lastKeyboardTS;
 
+    IOReturn messageGated(UInt32 *type, void *argument);
+    void readCompletedGated(int *slot);
+    bool shouldDiscardReport(AbsoluteTime timestamp);
+    void compileAxisTransform();
+    void compileRejectionZones();
+    void updateRejectionZones(RMI2DSensorReport *report);
+    bool isBelowDeltaThreshold(RMI2DSensorReport *report);
+    bool isRedundantEmptyFrame(RMI2DSensorReport *report);
+    void resampleReport(RMI2DSensorReport *report);
+    void resampleTick(IOTimerEventSource *sender);
+    void interpolateReport(uint64_t time, RMI2DSensorReport *out);
+    void publishResamplerStats();
+    
+    inline u8 lookupZone(u16 x, u16 y) {
+        return zoneGrid[rmi_fixed_mul(y, zoneScaleY)][rmi_fixed_mul(x, zoneScaleX)];
+    }
     MT2FingerType getFingerType();
-    void setThumbFingerType(int fingers, RMI2DSensorReport *report);
+    void recordHistory(int slot, rmi_2d_sensor_abs_object *obj);
+    void resetHistory(int slot);
+    void estimateVelocity(int slot, int *vx, int *vy);
+    int pickThumbCandidate(int fingers);
+    void classifyThumb(int fingers);
     void handleReport(RMI2DSensorReport *report);
 };
 
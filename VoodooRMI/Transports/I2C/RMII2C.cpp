@@ -149,9 +149,10 @@ int RMII2C::rmi_set_page(u8 page) {
         RMI_PAGE_SELECT_REGISTER,
         page };
 
-    if (device_nub->writeI2C(writeReport, sizeof(writeReport)) != kIOReturnSuccess) {
+    IOReturn ret = device_nub->writeI2C(writeReport, sizeof(writeReport));
+    if (ret != kIOReturnSuccess) {
         IOLog("%s::%s failed to write request output report\n", getName(), name);
-        return -1;
+        return errorFromIOReturn(ret);
     }
 
     this->page = page;
@@ -191,8 +192,9 @@ int RMII2C::reset() {
 
 bool RMII2C::handleOpen(IOService *forClient, IOOptionBits options, void *arg) {
     if (forClient && forClient->getProperty(RMIBusIdentifier)) {
-        bus = forClient;
-        bus->retain();
+        // Takes the bus and starts the transfer queue
+        if (!RMITransport::handleOpen(forClient, options, arg))
+            return false;
 
         startInterrupt();
         return true;
@@ -216,6 +218,7 @@ int RMII2C::readBlock(u16 rmiaddr, u8 *databuff, size_t len) {
         (u8) (len >> 8) };
 
     u8 *i2cInput = new u8[len+4];
+    IOReturn ret;
     memset(databuff, 0, len);
 
     IOLockLock(page_mutex);
@@ -225,15 +228,16 @@ int RMII2C::readBlock(u16 rmiaddr, u8 *databuff, size_t len) {
             goto exit;
     }
 
-    if (device_nub->writeReadI2C(writeReport, sizeof(writeReport), i2cInput, len+4) != kIOReturnSuccess) {
+    ret = device_nub->writeReadI2C(writeReport, sizeof(writeReport), i2cInput, len+4);
+    if (ret != kIOReturnSuccess) {
         IOLog("%s::%s failed to read I2C input\n", getName(), name);
-        retval = -1;
+        retval = errorFromIOReturn(ret);
         goto exit;
     }
 
     if (i2cInput[2] != RMI_READ_DATA_REPORT_ID) {
         IOLog("%s::%s RMI_READ_DATA_REPORT_ID mismatch %d\n", getName(), name, i2cInput[2]);
-        retval = -1;
+        retval = -RMI_ERR_PROTOCOL;
         goto exit;
     }
 
@@ -255,6 +259,7 @@ exit:
 
 int RMII2C::blockWrite(u16 rmiaddr, u8 *buf, size_t len) {
     int retval = 0;
+    IOReturn ret;
     u8 *writeReport = new u8[len+8] {
         HID_OUTPUT_REGISTER,  // outputRegister & 0xFF; wOutputRegister
         HID_OUTPUT_REGISTER >> 8,  // outputRegister >> 8;
@@ -274,9 +279,10 @@ int RMII2C::blockWrite(u16 rmiaddr, u8 *buf, size_t len) {
 
     memcpy(writeReport+8, buf, len);
 
-    if (device_nub->writeI2C(writeReport, len+8) != kIOReturnSuccess) {
+    ret = device_nub->writeI2C(writeReport, len+8);
+    if (ret != kIOReturnSuccess) {
         IOLog("%s::%s failed to write request output report\n", getName(), name);
-        retval = -1;
+        retval = errorFromIOReturn(ret);
         goto exit;
     }
     retval = 0;
@@ -0,0 +1,357 @@
+/* SPDX-License-Identifier: GPL-2.0-only
+ * RMI4 Sensor Controller for macOS
+ *
+ * Copyright (c) 2020 Avery Black
+ */
+
+#include "RMITransport.hpp"
+
+OSDefineMetaClassAndStructors(RMITransport, IOService)
+
+bool RMITransport::startTransferQueue()
+{
+    if (transfer_loop)
+        return true;
+    
+    if (!transfer_lock)
+        transfer_lock = IOLockAlloc();
+    transfer_loop = IOWorkLoop::workLoop();
+    completion_loop = IOWorkLoop::workLoop();
+    transfer_source = IOInterruptEventSource::interruptEventSource(this,
+        OSMemberFunctionCast(IOInterruptEventAction, this, &RMITransport::runTransfers));
+    completion_source = IOInterruptEventSource::interruptEventSource(this,
+        OSMemberFunctionCast(IOInterruptEventAction, this, &RMITransport::completeTransfers));
+    
+    if (!transfer_lock || !transfer_loop || !completion_loop ||
+        !transfer_source || !completion_source ||
+        transfer_loop->addEventSource(transfer_source) != kIOReturnSuccess ||
+        completion_loop->addEventSource(completion_source) != kIOReturnSuccess) {
+        stopTransferQueue();
+        return false;
+    }
+    
+    memset(transfers, 0, sizeof(transfers));
+    transfer_head = transfer_next = transfer_count = 0;
+    
+    transfer_source->enable();
+    completion_source->enable();
+    
+    IOLockLock(transfer_lock);
+    transfer_open = true;
+    IOLockUnlock(transfer_lock);
+    return true;
+}
+
+void RMITransport::stopTransferQueue()
+{
+    rmi_transfer *xfer;
+    
+    // Turn away new transfers, once this returns nobody is in submitTransfer anymore
+    if (transfer_lock) {
+        IOLockLock(transfer_lock);
+        transfer_open = false;
+        IOLockUnlock(transfer_lock);
+    }
+    
+    // Waits for whatever is running on either thread
+    if (transfer_source) {
+        transfer_source->disable();
+        transfer_loop->removeEventSource(transfer_source);
+    }
+    
+    if (completion_source) {
+        completion_source->disable();
+        completion_loop->removeEventSource(completion_source);
+    }
+    
+    // Nothing runs anymore, let everyone know their transfer won't happen
+    while (transfer_count) {
+        xfer = &transfers[transfer_head];
+        transfer_head = (transfer_head + 1) % RMI_TRANSFER_QUEUE_SIZE;
+        transfer_count--;
+        
+        int result = xfer->state == RMI_TRANSFER_DONE ? xfer->result : -ECANCELED;
+        xfer->state = RMI_TRANSFER_FREE;
+        xfer->action(xfer->owner, xfer->context, result, &xfer->stats);
+        OSSafeReleaseNULL(xfer->owner);
+    }
+    
+    OSSafeReleaseNULL(transfer_source);
+    OSSafeReleaseNULL(completion_source);
+    OSSafeReleaseNULL(transfer_loop);
+    OSSafeReleaseNULL(completion_loop);
+}
+
+void RMITransport::free()
+{
+    stopTransferQueue();
+    
+    if (transfer_lock) {
+        IOLockFree(transfer_lock);
+        transfer_lock = nullptr;
+    }
+    
+    IOService::free();
+}
+
+int RMITransport::submitTransfer(u16 rmiaddr, u8 *buf, size_t len, bool write,
+                                 OSObject *owner, RMITransferAction action, void *context)
+{
+    rmi_transfer *xfer;
+    
+    if (!transfer_lock || !action)
+        return -ENODEV;
+    
+    IOLockLock(transfer_lock);
+    if (!transfer_open) {
+        IOLockUnlock(transfer_lock);
+        return -ENODEV;
+    }
+    
+    if (transfer_count == RMI_TRANSFER_QUEUE_SIZE) {
+        IOLockUnlock(transfer_lock);
+        return -EBUSY;
+    }
+    
+    xfer = &transfers[(transfer_head + transfer_count) % RMI_TRANSFER_QUEUE_SIZE];
+    xfer->state = RMI_TRANSFER_QUEUED;
+    xfer->rmiaddr = rmiaddr;
+    xfer->buf = buf;
+    xfer->len = len;
+    xfer->write = write;
+    xfer->result = 0;
+    memset(&xfer->stats, 0, sizeof(xfer->stats));
+    xfer->owner = owner;
+    xfer->action = action;
+    xfer->context = context;
+    
+    if (owner)
+        owner->retain();
+    
+    transfer_count++;
+    
+    // Still under the lock, so stopTransferQueue can't release the source meanwhile
+    transfer_source->interruptOccurred(nullptr, nullptr, 0);
+    IOLockUnlock(transfer_lock);
+    return 0;
+}
+
+void RMITransport::runTransfers(IOInterruptEventSource *sender, int count)
+{
+    rmi_transfer *xfer;
+    rmi_transfer current;
+    
+    while (true) {
+        IOLockLock(transfer_lock);
+        xfer = &transfers[transfer_next];
+        if (xfer->state != RMI_TRANSFER_QUEUED) {
+            IOLockUnlock(transfer_lock);
+            break;
+        }
+        current = *xfer;
+        IOLockUnlock(transfer_lock);
+        
+        if (current.write) {
+            current.result = blockWrite(current.rmiaddr, current.buf, current.len);
+            current.stats.transactions = 1;
+        } else {
+            current.result = readRetried(current.rmiaddr, current.buf, current.len, true, &current.stats);
+        }
+        
+        IOLockLock(transfer_lock);
+        xfer->result = current.result < 0 ? current.result : 0;
+        xfer->stats = current.stats;
+        xfer->state = RMI_TRANSFER_DONE;
+        transfer_next = (transfer_next + 1) % RMI_TRANSFER_QUEUE_SIZE;
+        IOLockUnlock(transfer_lock);
+        
+        completion_source->interruptOccurred(nullptr, nullptr, 0);
+    }
+}
+
+void RMITransport::completeTransfers(IOInterruptEventSource *sender, int count)
+{
+    rmi_transfer *xfer;
+    rmi_transfer current;
+    
+    while (true) {
+        IOLockLock(transfer_lock);
+        xfer = &transfers[transfer_head];
+        if (!transfer_count || xfer->state != RMI_TRANSFER_DONE) {
+            IOLockUnlock(transfer_lock);
+            break;
+        }
+        
+        // Free the slot first so the action can queue up the next one
+        current = *xfer;
+        xfer->state = RMI_TRANSFER_FREE;
+        transfer_head = (transfer_head + 1) % RMI_TRANSFER_QUEUE_SIZE;
+        transfer_count--;
+        IOLockUnlock(transfer_lock);
+        
+        current.action(current.owner, current.context, current.result, &current.stats);
+        OSSafeReleaseNULL(current.owner);
+    }
+}
+
+int RMITransport::errorFromIOReturn(IOReturn ret)
+{
+    switch (ret) {
+        case kIOReturnSuccess:
+            return 0;
+        case kIOReturnNoDevice:
+        case kIOReturnNotResponding:
+        case kIOReturnNotAttached:
+            return -RMI_ERR_NAK;
+        case kIOReturnTimeout:
+            return -RMI_ERR_TIMEOUT;
+        case kIOReturnBusy:
+        case kIOReturnCannotLock:
+            return -RMI_ERR_ARBITRATION;
+        default:
+            return -EIO;
+    }
+}
+
+/*
+ * For nubs that hand back the -errno of the SMBus controller, which are
+ * the values of the headers they were built with. Results that aren't
+ * errors go through as they are
+ */
+int RMITransport::errorFromErrno(int ret)
+{
+    if (ret >= 0)
+        return ret;
+    
+    switch (-ret) {
+        case ENXIO:
+            return -RMI_ERR_NAK;
+        case ETIMEDOUT:
+            return -RMI_ERR_TIMEOUT;
+        case EAGAIN:
+        case EBUSY:
+            return -RMI_ERR_ARBITRATION;
+        case EPROTO:
+        case EBADMSG:
+            return -RMI_ERR_PROTOCOL;
+        default:
+            return -EIO;
+    }
+}
+
+rmi_transport_error RMITransport::classifyError(int error)
+{
+    if (-error < RMI_TRANSPORT_ERRNO_BASE ||
+        -error >= RMI_TRANSPORT_ERRNO_BASE + RMI_TRANSPORT_OTHER)
+        return RMI_TRANSPORT_OTHER;
+    
+    return static_cast<rmi_transport_error>(-error - RMI_TRANSPORT_ERRNO_BASE);
+}
+
+int RMITransport::readRetried(u16 rmiaddr, u8 *databuff, size_t len, bool canSleep,
+                              rmi_transfer_stats *stats)
+{
+    AbsoluteTime start, now;
+    UInt64 elapsed;
+    UInt32 backoff;
+    rmi_transport_error type;
+    int retval, attempt = 0;
+    
+    clock_get_uptime(&start);
+    
+    while (true) {
+        retval = readBlock(rmiaddr, databuff, len);
+        if (retval >= 0)
+            break;
+        
+        type = classifyError(retval);
+        OSIncrementAtomic(&error_counts[type]);
+        
+        // Anything else isn't going to fix itself by asking again
+        if (type == RMI_TRANSPORT_OTHER || attempt == RMI_READ_MAX_RETRIES)
+            break;
+        
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - start, &elapsed);
+        if (elapsed / 1000000 >= RMI_READ_DEADLINE_MS)
+            break;
+        
+        // Give the bus a moment, without sleeping past the deadline
+        if (canSleep) {
+            backoff = min(RMI_READ_BACKOFF_MS << attempt,
+                          RMI_READ_DEADLINE_MS - (UInt32) (elapsed / 1000000));
+            IOSleep(backoff);
+        }
+        
+        attempt++;
+        OSIncrementAtomic(&read_retries);
+    }
+    
+    // Every attempt but a successful last one failed
+    if (stats) {
+        stats->transactions = 1;
+        stats->retries = attempt;
+        stats->errors = attempt + (retval < 0);
+    }
+    
+    if (retval >= 0) {
+        failed_in_row = 0;
+        if (attempt) {
+            OSIncrementAtomic(&reads_recovered);
+            publishErrorStats();
+        }
+        return retval;
+    }
+    
+    OSIncrementAtomic(&reads_failed);
+    if (OSIncrementAtomic(&failed_in_row) + 1 >= RMI_READ_RESET_THRESHOLD) {
+        IOLog("%s: %d reads failed in a row, recovering\n", getName(), failed_in_row);
+        failed_in_row = 0;
+        OSIncrementAtomic(&error_resets);
+        if (bus)
+            messageClient(kIOMessageRMITransportRecover, bus);
+        publishErrorStats(true);
+        return retval;
+    }
+    
+    publishErrorStats();
+    return retval;
+}
+
+void RMITransport::publishErrorStats(bool force)
+{
+    OSDictionary *stats;
+    OSNumber *value;
+    AbsoluteTime now;
+    UInt64 elapsed;
+    
+    // Failing reads come in bursts, don't build a dictionary for each of them
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - stats_published, &elapsed);
+    if (!force && stats_published && elapsed / 1000000 < RMI_ERROR_STATS_INTERVAL_MS)
+        return;
+    stats_published = now;
+    
+    stats = OSDictionary::withCapacity(9);
+    if (!stats)
+        return;
+    
+#define SET_STAT(key, stat) \
+    value = OSNumber::withNumber(stat, 32); \
+    stats->setObject(key, value); \
+    OSSafeReleaseNULL(value);
+    
+    SET_STAT("NAK", error_counts[RMI_TRANSPORT_NAK]);
+    SET_STAT("Timeout", error_counts[RMI_TRANSPORT_TIMEOUT]);
+    SET_STAT("Arbitration Lost", error_counts[RMI_TRANSPORT_ARBITRATION]);
+    SET_STAT("Protocol", error_counts[RMI_TRANSPORT_PROTOCOL]);
+    SET_STAT("Other", error_counts[RMI_TRANSPORT_OTHER]);
+    SET_STAT("Retries", read_retries);
+    SET_STAT("Recovered Reads", reads_recovered);
+    SET_STAT("Failed Reads", reads_failed);
+    SET_STAT("Resets", error_resets);
+#undef SET_STAT
+    
+    setProperty("Transport Errors", stats);
+    OSSafeReleaseNULL(stats);
+}
@@ -13,14 +13,91 @@
 
 #include <IOKit/IOLib.h>
 #include <IOKit/IOService.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOInterruptEventSource.h>
 #include "../Utility/LinuxCompat.h"
 
 #define kIOMessageVoodooSMBusHostNotify iokit_vendor_specific_msg(420)
 #define kIOMessageVoodooI2CHostNotify   iokit_vendor_specific_msg(421)
 #define kIOMessageVoodooI2CLegacyHostNotify   iokit_vendor_specific_msg(422)
+// Transport to bus, reads keep failing and the device needs to be brought back
+#define kIOMessageRMITransportRecover   iokit_vendor_specific_msg(423)
 #define RMIBusIdentifier "Synaptics RMI4 Device"
 #define RMIBusSupported "RMI4 Supported"
 
+#define RMI_TRANSFER_QUEUE_SIZE 4
+
+/*
+ * Reads are retried on errors that are likely to go away, as long as the
+ * whole read stays within the deadline. The transfer thread backs off
+ * between attempts, doubling from RMI_READ_BACKOFF_MS. The attention
+ * thread retries right away, it must not block.
+ * Reads that still fail that many times in a row have the bus recover
+ * the device, away from those threads
+ */
+#define RMI_READ_MAX_RETRIES        3
+#define RMI_READ_DEADLINE_MS        10
+#define RMI_READ_BACKOFF_MS         1
+#define RMI_READ_RESET_THRESHOLD    5
+
+// Error stats are published at most this often
+#define RMI_ERROR_STATS_INTERVAL_MS 1000
+
+enum rmi_transport_error {
+    RMI_TRANSPORT_NAK,          // nobody answered
+    RMI_TRANSPORT_TIMEOUT,
+    RMI_TRANSPORT_ARBITRATION,  // lost the bus to another master
+    RMI_TRANSPORT_PROTOCOL,     // the answer didn't make sense
+    RMI_TRANSPORT_OTHER,
+    RMI_TRANSPORT_ERROR_COUNT
+};
+
+/*
+ * Transports return these negated for failed transfers, like errnos.
+ * They are kept clear of errno values, which the nubs return as BSD or
+ * Linux depending on how they were built. Nub results are translated by
+ * errorFromIOReturn and errorFromErrno, anything else is an errno
+ */
+#define RMI_TRANSPORT_ERRNO_BASE    1000
+#define RMI_ERR_NAK                 (RMI_TRANSPORT_ERRNO_BASE + RMI_TRANSPORT_NAK)
+#define RMI_ERR_TIMEOUT             (RMI_TRANSPORT_ERRNO_BASE + RMI_TRANSPORT_TIMEOUT)
+#define RMI_ERR_ARBITRATION         (RMI_TRANSPORT_ERRNO_BASE + RMI_TRANSPORT_ARBITRATION)
+#define RMI_ERR_PROTOCOL            (RMI_TRANSPORT_ERRNO_BASE + RMI_TRANSPORT_PROTOCOL)
+
+// What a single read or transfer cost, counted by whoever issued it
+struct rmi_transfer_stats {
+    UInt32 transactions;
+    UInt32 retries;
+    UInt32 errors;
+};
+
+/*
+ * Called on the transport's completion thread once a submitted transfer
+ * is done, in the same order they were submitted. result is 0 or a
+ * negative error as above, stats is what the transfer took
+ */
+typedef void (*RMITransferAction)(OSObject *owner, void *context, int result,
+                                  const rmi_transfer_stats *stats);
+
+enum rmi_transfer_state {
+    RMI_TRANSFER_FREE,
+    RMI_TRANSFER_QUEUED,
+    RMI_TRANSFER_DONE,
+};
+
+struct rmi_transfer {
+    rmi_transfer_state state;
+    u16 rmiaddr;
+    u8 *buf;
+    size_t len;
+    bool write;
+    int result;
+    rmi_transfer_stats stats;
+    OSObject *owner;
+    RMITransferAction action;
+    void *context;
+};
+
 // power management
 static IOPMPowerState RMIPowerStates[] = {
     {1, 0                , 0, 0           , 0, 0, 0, 0, 0, 0, 0, 0},
@@ -38,14 +115,33 @@ public:
     virtual int readBlock(u16 rmiaddr, u8 *databuff, size_t len) {return 0;};
     // rmi_block_write
     virtual int blockWrite(u16 rmiaddr, u8 *buf, size_t len) {return 0;};
+    // Hint that this exact read happens all the time
+    virtual int pinRead(u16 rmiaddr, size_t len) {return 0;};
     
     virtual int reset() {return 0;};
     
+    // readBlock, retried and counted as above. Only sleeps with canSleep
+    int readRetried(u16 rmiaddr, u8 *databuff, size_t len, bool canSleep = false,
+                    rmi_transfer_stats *stats = nullptr);
+    
+    void free() override;
+    
+    /*
+     * Queue a transfer without waiting for it. Neither nub can do this
+     * natively, so transfers run on a thread of their own using readBlock
+     * and blockWrite, and completions are handed to a second one. That way
+     * the next transfer is already going while the last one gets parsed.
+     * buf must stay valid until action is called. Only works while open
+     */
+    int submitTransfer(u16 rmiaddr, u8 *buf, size_t len, bool write,
+                       OSObject *owner, RMITransferAction action, void *context);
+    
     /*
      * IMPORTANT: These handleClose/handleOpen must be called. These can be overriden,
      * but said implementation must call the ones below.
      */
     inline virtual void handleClose(IOService *forClient, IOOptionBits options) override {
+        stopTransferQueue();
         OSSafeReleaseNULL(bus);
         IOService::handleClose(forClient, options);
     }
@@ -55,6 +151,9 @@ public:
             bus = forClient;
             bus->retain();
             
+            if (!startTransferQueue())
+                IOLog("%s: Could not start transfer queue, only synchronous transfers are available\n", getName());
+            
             return true;
         }
         
@@ -63,6 +162,41 @@ public:
     
 protected:
     IOService *bus {nullptr};
+    
+    static int errorFromIOReturn(IOReturn ret);
+    static int errorFromErrno(int ret);
+    
+private:
+    // Reads come from both the attention and the transfer thread
+    volatile SInt32 error_counts[RMI_TRANSPORT_ERROR_COUNT] {};
+    volatile SInt32 read_retries {0};
+    volatile SInt32 reads_recovered {0};
+    volatile SInt32 reads_failed {0};
+    volatile SInt32 error_resets {0};
+    volatile SInt32 failed_in_row {0};
+    AbsoluteTime stats_published {0};
+    
+    static rmi_transport_error classifyError(int error);
+    void publishErrorStats(bool force = false);
+    
+    IOWorkLoop *transfer_loop {nullptr};
+    IOWorkLoop *completion_loop {nullptr};
+    IOInterruptEventSource *transfer_source {nullptr};
+    IOInterruptEventSource *completion_source {nullptr};
+    // Lives until free, so a late submitTransfer can still take it
+    IOLock *transfer_lock {nullptr};
+    bool transfer_open {false};
+    
+    // Queued transfers are contiguous from transfer_head, done ones first
+    rmi_transfer transfers[RMI_TRANSFER_QUEUE_SIZE];
+    u8 transfer_head {0};
+    u8 transfer_next {0};
+    u8 transfer_count {0};
+    
+    bool startTransferQueue();
+    void stopTransferQueue();
+    void runTransfers(IOInterruptEventSource *sender, int count);
+    void completeTransfers(IOInterruptEventSource *sender, int count);
 };
 
 #endif // RMITransport_H
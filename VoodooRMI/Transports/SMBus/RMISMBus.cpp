@@ -76,7 +76,7 @@ void RMISMBus::free()
         IOLockFree(page_mutex);
     if (mapping_table_mutex)
         IOLockFree(mapping_table_mutex);
-    super::free();
+    RMITransport::free();
 }
 
 int RMISMBus::rmi_smb_get_version()
@@ -92,6 +92,141 @@ int RMISMBus::rmi_smb_get_version()
     return retval + 1;
 }
 
+int RMISMBus::reset()
+{
+    int retval;
+    
+    /*
+     * I don't think this does a full reset, as it still seems to retain memory
+     * I believe a PS2 reset needs to be done to completely reset the sensor
+     */
+    retval = rmi_smb_get_version();
+    if (retval < 0)
+        return retval;
+    
+    /*
+     * The sensor may have forgotten its mapping table,
+     * so start the rotating entries over and put the chains back
+     */
+    IOLockLock(page_mutex);
+    IOLockLock(mapping_table_mutex);
+    
+    memset(mapping_table, 0, sizeof(mapping_table));
+    table_index = 0;
+    
+    for (int i = 0; i < chain_count; i++) {
+        if (rmi_smb_program_chain(&chains[i]) < 0)
+            IOLog("Error: Could not restore mapping chain for %#06x\n", chains[i].rmiaddr);
+    }
+    
+    IOLockUnlock(mapping_table_mutex);
+    IOLockUnlock(page_mutex);
+    
+    return retval;
+}
+
+/*
+ * Not from rmi_smbus
+ * Writes every entry of a chain to the device. Expects both locks held
+ */
+int RMISMBus::rmi_smb_program_chain(struct mapping_chain *chain)
+{
+    struct mapping_table_entry new_map;
+    size_t remaining = chain->len;
+    int retval = 0;
+    
+    for (int i = 0; i < chain->count; i++) {
+        u8 index = chain->first + i;
+        
+        memset(&new_map, 0, sizeof(new_map));
+        new_map.rmiaddr = OSSwapHostToLittleInt16(chain->rmiaddr + i * SMB_MAX_COUNT);
+        new_map.readcount = min(remaining, (size_t) SMB_MAX_COUNT);
+        
+        retval = device_nub->writeBlockData(index + 0x80, sizeof(new_map),
+                                            reinterpret_cast<u8*>(&new_map));
+        mapping_writes++;
+        if (retval < 0) {
+            memset(&mapping_table[index], 0, sizeof(new_map));
+            return retval;
+        }
+        
+        mapping_table[index] = new_map;
+        remaining -= new_map.readcount;
+    }
+    
+    return 0;
+}
+
+/*
+ * Not from rmi_smbus
+ * Reserve mapping entries at the top of the table for a read that happens
+ * on every attention, so it never has to rewrite the mapping or even look
+ * for it. Anything that doesn't fit just keeps using the rotating entries
+ */
+int RMISMBus::pinRead(u16 rmiaddr, size_t len)
+{
+    struct mapping_chain *chain;
+    int count = DIV_ROUND_UP(len, SMB_MAX_COUNT);
+    int retval = 0;
+    
+    IOLockLock(page_mutex);
+    IOLockLock(mapping_table_mutex);
+    
+    for (int i = 0; i < chain_count; i++) {
+        if (chains[i].rmiaddr == rmiaddr && chains[i].len == len)
+            goto exit;
+    }
+    
+    if (!len || chain_count == RMI_SMB2_MAX_CHAINS ||
+        pinned_entries + count > RMI_SMB2_MAX_PINNED) {
+        retval = -ENOMEM;
+        goto exit;
+    }
+    
+    chain = &chains[chain_count];
+    chain->rmiaddr = rmiaddr;
+    chain->len = len;
+    chain->count = count;
+    chain->first = RMI_SMB2_MAP_SIZE - pinned_entries - count;
+    
+    retval = rmi_smb_program_chain(chain);
+    if (retval < 0)
+        goto exit;
+    
+    chain_count++;
+    pinned_entries += count;
+    table_index %= RMI_SMB2_MAP_SIZE - pinned_entries;
+    
+exit:
+    IOLockUnlock(mapping_table_mutex);
+    IOLockUnlock(page_mutex);
+    return retval;
+}
+
+void RMISMBus::publishReadStats()
+{
+    OSDictionary *stats = OSDictionary::withCapacity(5);
+    OSNumber *value;
+    
+    if (!stats)
+        return;
+    
+#define SET_STAT(key, stat) \
+    value = OSNumber::withNumber(stat, 32); \
+    stats->setObject(key, value); \
+    OSSafeReleaseNULL(value);
+    
+    SET_STAT("Pinned Reads", pinned_reads);
+    SET_STAT("Pinned Transactions", pinned_transactions);
+    SET_STAT("Other Reads", reads);
+    SET_STAT("Other Transactions", read_transactions);
+    SET_STAT("Mapping Writes", mapping_writes);
+#undef SET_STAT
+    
+    setProperty("Read Transactions", stats);
+    OSSafeReleaseNULL(stats);
+}
+
 /*
  * The function to get command code for smbus operations and keeps
  * records to the driver mapping table
@@ -120,8 +255,9 @@ int RMISMBus::rmi_smb_get_command_code(u16 rmiaddr, int bytecount,
         }
     }
     
+    // Pinned chains sit at the top of the table
     i = table_index;
-    table_index = (i + 1) % RMI_SMB2_MAP_SIZE;
+    table_index = (i + 1) % (RMI_SMB2_MAP_SIZE - pinned_entries);
     
     /* constructs mapping table data entry. 4 bytes each entry */
     memset(&new_map, 0, sizeof(new_map));
@@ -130,6 +266,7 @@ int RMISMBus::rmi_smb_get_command_code(u16 rmiaddr, int bytecount,
     new_map.flags = !isread ? RMI_SMB2_MAP_FLAGS_WE : 0;
     retval = device_nub->writeBlockData(i + 0x80,
                                          sizeof(new_map), reinterpret_cast<u8*>(&new_map));
+    mapping_writes++;
     if (retval < 0) {
         /*
          * if not written to device mapping table
@@ -155,10 +292,30 @@ int RMISMBus::readBlock(u16 rmiaddr, u8 *databuff, size_t len) {
     int retval;
     u8 commandcode;
     int cur_len = (int)len;
+    UInt32 total;
     
     IOLockLock(page_mutex);
     memset(databuff, 0, len);
     
+    // Chains only change with page_mutex held, and their entries are already on the device
+    for (int i = 0; i < chain_count; i++) {
+        struct mapping_chain *chain = &chains[i];
+        
+        if (chain->rmiaddr != rmiaddr || chain->len != len)
+            continue;
+        
+        for (int j = 0; j < chain->count; j++) {
+            retval = device_nub->readBlockData(chain->first + j, databuff + j * SMB_MAX_COUNT);
+            pinned_transactions++;
+            if (retval < 0)
+                goto exit;
+        }
+        
+        pinned_reads++;
+        retval = 0;
+        goto exit;
+    }
+    
     while (cur_len > 0) {
         /* break into 8 bytes chunks to write get command code */
         int block_len =  min(cur_len, SMB_MAX_COUNT);
@@ -169,6 +326,7 @@ int RMISMBus::readBlock(u16 rmiaddr, u8 *databuff, size_t len) {
             goto exit;
         
         retval = device_nub->readBlockData(commandcode, databuff);
+        read_transactions++;
         
         if (retval < 0)
             goto exit;
@@ -179,10 +337,19 @@ int RMISMBus::readBlock(u16 rmiaddr, u8 *databuff, size_t len) {
         rmiaddr += SMB_MAX_COUNT;
     }
     
+    reads++;
     retval = 0;
     
 exit:
+    total = pinned_reads + reads;
     IOLockUnlock(page_mutex);
+    
+    // Everything that failed up there came straight from the nub
+    retval = errorFromErrno(retval);
+    
+    if (retval == 0 && total % RMI_SMB_STATS_INTERVAL == 0)
+        publishReadStats();
+    
     return retval;
 }
 
@@ -218,7 +385,7 @@ int RMISMBus::blockWrite(u16 rmiaddr, u8 *buf, size_t len)
     
 exit:
     IOLockUnlock(page_mutex);
-    return retval;
+    return errorFromErrno(retval);
 }
 
 IOReturn RMISMBus::message(UInt32 type, IOService *provider, void *argument) {
@@ -17,6 +17,9 @@
 #define SMB_MAX_COUNT                   32
 #define RMI_SMB2_MAP_SIZE               8 /* 8 entry of 4 bytes each */
 #define RMI_SMB2_MAP_FLAGS_WE           0x01
+#define RMI_SMB2_MAX_PINNED             4 /* Entries kept for hot reads, the rest rotate */
+#define RMI_SMB2_MAX_CHAINS             3
+#define RMI_SMB_STATS_INTERVAL          1000 /* Reads between publishing stats */
 
 struct mapping_table_entry {
     __le16 rmiaddr;
@@ -24,6 +27,14 @@ struct mapping_table_entry {
     u8 flags;
 };
 
+/* Consecutive mapping entries covering one read, programmed ahead of time */
+struct mapping_chain {
+    u16 rmiaddr;
+    size_t len;
+    u8 first;
+    u8 count;
+};
+
 class RMISMBus : public RMITransport {
     OSDeclareDefaultStructors(RMISMBus);
     
@@ -37,14 +48,8 @@ public:
     
     int readBlock(u16 rmiaddr, u8 *databuff, size_t len) override;
     int blockWrite(u16 rmiaddr, u8 *buf, size_t len) override;
-    
-    inline int reset() override {
-        /*
-         * I don't think this does a full reset, as it still seems to retain memory
-         * I believe a PS2 reset needs to be done to completely reset the sensor
-         */
-        return rmi_smb_get_version();
-    }
+    int pinRead(u16 rmiaddr, size_t len) override;
+    int reset() override;
 private:
     VoodooSMBusDeviceNub *device_nub;
     IOLock *page_mutex;
@@ -53,9 +58,21 @@ private:
     struct mapping_table_entry mapping_table[RMI_SMB2_MAP_SIZE];
     u8 table_index;
     
+    struct mapping_chain chains[RMI_SMB2_MAX_CHAINS];
+    u8 chain_count {0};
+    u8 pinned_entries {0};
+    
+    UInt32 pinned_reads {0};
+    UInt32 pinned_transactions {0};
+    UInt32 reads {0};
+    UInt32 read_transactions {0};
+    UInt32 mapping_writes {0};
+    
     int rmi_smb_get_version();
     int rmi_smb_get_command_code(u16 rmiaddr, int bytecount,
                                  bool isread, u8 *commandcode);
+    int rmi_smb_program_chain(struct mapping_chain *chain);
+    void publishReadStats();
 };
 
 #endif /* RMISMBus_h */
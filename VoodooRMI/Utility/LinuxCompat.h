@@ -31,10 +31,15 @@ typedef s64 __s64;
 
 // https://github.com/torvalds/linux/blob/master/include/uapi/asm-generic/errno-base.h
 #define EIO     5
+#define ENXIO   6
 #define ENOMEM  12
+#define EBUSY   16
 #define ENODEV  19
 #define EINVAL  22
 
+// Anything past errno-base differs from BSD, so those come from the system
+#include <sys/errno.h>
+
 #define BITS_PER_LONG       (BITS_PER_BYTE * __SIZEOF_LONG__)
 #define BIT(nr) (1UL << (nr))
 
@@ -48,6 +53,7 @@ typedef s64 __s64;
 
 // kernel.h
 #define DIV_ROUND_UP(n,d) (((n) + (d) - 1) / (d))
+#define DIV_ROUND_CLOSEST(n,d) (((n) + (d) / 2) / (d))
 
 // unaligned/le_byteshift.h
 static inline u32 __get_unaligned_le32(const u8 *p)
@@ -33,7 +33,7 @@ enum {
 
 // RMI message types
 enum {
-    kHandleRMIAttention = iokit_vendor_specific_msg(2046),
+    kHandleRMIAttention = iokit_vendor_specific_msg(2046),           // data is AbsoluteTime* of when the attention came in
     kHandleRMIClickpadSet = iokit_vendor_specific_msg(2047),
     kHandleRMISuspend = iokit_vendor_specific_msg(2048),
     kHandleRMIResume = iokit_vendor_specific_msg(2049),
@@ -135,22 +135,36 @@ public:
         this->fn_descriptor = desc;
     }
     
-    inline void setMask(unsigned long irqMask) {
-        irq_mask = irqMask;
+    inline void setIrqPos(unsigned int irqPos) {
+        this->irqPos = irqPos;
     }
     
-    inline void setIrqPos(unsigned int irqPos) {
-        irqPos = irqPos;
+    inline void setIrqCount(unsigned int irqCount) {
+        this->irqCount = irqCount;
     }
     
-    inline unsigned long getIRQ() {
-        return irq_mask;
+    // A function's IRQs are always next to each other in the bitmap
+    inline void getIRQ(unsigned long *bitmap) {
+        if (irqCount)
+            bitmap_set(bitmap, irqPos, irqCount);
+    }
+    
+    inline bool hasIRQ(unsigned int bit) {
+        return bit >= irqPos && bit < irqPos + irqCount;
     }
     
     inline unsigned int getIRQPos() {
         return irqPos;
     }
     
+    inline unsigned int getIRQCount() {
+        return irqCount;
+    }
+    
+    inline u8 getFunctionNumber() {
+        return fn_descriptor ? fn_descriptor->function_number : 0;
+    }
+    
     inline void clearDesc() {
         if(this->fn_descriptor)
             IOFree(this->fn_descriptor, sizeof(rmi_function_descriptor));
@@ -158,8 +172,8 @@ public:
     }
     
 private:
-    unsigned long irq_mask;
-    unsigned int irqPos;
+    unsigned int irqPos {0};
+    unsigned int irqCount {0};
 protected:
     rmi_function_descriptor *fn_descriptor;
 };
@@ -252,13 +266,22 @@ struct rmi_driver_data {
     rmi_function *f01_container;
     rmi_function *f34_container;
     bool bootloader_mode;
+    bool pdt_cached;
+    /* PDT this sensor was probed with, see rmi_driver.hpp */
+    struct rmi_topology_cache *topology;
     
     int num_of_irq_regs;
     int irq_count;
-    unsigned long irq_status;
-    unsigned long fn_irq_bits;
-    unsigned long current_irq_mask;
-    unsigned long new_irq_mask;
+    /* Bitmaps of irq_count bits, all carved out of irq_memory */
+    size_t irq_memory_size;
+    unsigned long *irq_memory;
+    unsigned long *irq_status;
+    unsigned long *fn_irq_bits;
+    unsigned long *current_irq_mask;
+    unsigned long *new_irq_mask;
+    unsigned long *fn_mask;
+    /* Only touched by the attention path, so it never waits on irq_mutex */
+    unsigned long *attn_status;
     IOLock *irq_mutex;
     
     struct irq_domain *irqdomain;
@@ -15,6 +15,7 @@
  */
 
 #include "rmi_driver.hpp"
+#include <IOKit/assert.h>
 
 #define HAS_NONSTANDARD_PDT_MASK 0x40
 #define RMI4_MAX_PAGE 0xff
@@ -24,8 +25,17 @@
 #define RMI_DEVICE_RESET_CMD    0x01
 #define DEFAULT_RESET_DELAY_MS    100
 
+static struct rmi_topology_cache topology_cache;
+static volatile UInt32 topology_busy;
+
+static int rmi_topology_lookup(RMIBus *dev, const struct pdt_entry *f01);
+static void rmi_topology_store(const struct rmi_topology_cache *topology);
+
 int rmi_driver_probe(RMIBus *dev)
 {
+    struct pdt_entry f01_pdt;
+    struct rmi_topology_cache *topology = dev->data->topology;
+    int lookup;
     int retval;
 
     /*
@@ -50,7 +60,8 @@ int rmi_driver_probe(RMIBus *dev)
      * continue processing.
      */
     
-    retval = rmi_scan_pdt(dev, NULL, rmi_initial_reset);
+    memset(&f01_pdt, 0, sizeof(f01_pdt));
+    retval = rmi_scan_pdt(dev, &f01_pdt, rmi_initial_reset);
     if (retval < 0)
         IOLog("RMI initial reset failed! Continuing in spite of this.\n");
     
@@ -64,10 +75,20 @@ int rmi_driver_probe(RMIBus *dev)
                  PDT_PROPERTIES_LOCATION, retval);
     }
     
+    lookup = rmi_topology_lookup(dev, &f01_pdt);
+    dev->data->pdt_cached = lookup > 0;
+    
     retval = rmi_probe_interrupts(dev, dev->data);
     if (retval)
         goto err;
     
+    if (!lookup && !dev->data->bootloader_mode &&
+        topology->entry_count <= RMI_TOPOLOGY_MAX_ENTRIES) {
+        topology->valid = true;
+        rmi_topology_store(topology);
+    }
+    
+    dev->setProperty("Topology Cached", dev->data->pdt_cached ? kOSBooleanTrue : kOSBooleanFalse);
     return 0;
 err:
     IOLogError("Could not probe");
@@ -141,6 +162,154 @@ static int rmi_scan_pdt_page(RMIBus *dev,
         RMI_SCAN_DONE : RMI_SCAN_CONTINUE;
 }
 
+static bool rmi_pdt_entry_equal(const struct pdt_entry *a,
+                                const struct pdt_entry *b)
+{
+    return a->page_start == b->page_start &&
+        a->query_base_addr == b->query_base_addr &&
+        a->command_base_addr == b->command_base_addr &&
+        a->control_base_addr == b->control_base_addr &&
+        a->data_base_addr == b->data_base_addr &&
+        a->interrupt_source_count == b->interrupt_source_count &&
+        a->function_version == b->function_version &&
+        a->function_number == b->function_number;
+}
+
+/*
+ * Not from rmi_driver
+ * Entries of a page are packed downwards from the start of the scan area
+ */
+static u16 rmi_cached_pdt_address(const struct rmi_topology_cache *topology,
+                                  int index)
+{
+    const struct pdt_entry *entry = &topology->entries[index];
+    int slot = 0;
+    
+    while (index-- > 0 && topology->entries[index].page_start == entry->page_start)
+        slot++;
+    
+    return entry->page_start + PDT_START_SCAN_LOCATION - slot * RMI_PDT_ENTRY_SIZE;
+}
+
+/*
+ * Not from rmi_driver
+ * Sensors probe on their own threads, so the shared cache is only ever
+ * copied in and out while holding topology_busy and never used in place.
+ * A plain flag rather than an IOLock, so there's nothing left to free when
+ * the kext unloads
+ */
+static void rmi_topology_lock()
+{
+    while (!OSCompareAndSwap(0, 1, &topology_busy))
+        IODelay(1);
+}
+
+static void rmi_topology_unlock()
+{
+    OSCompareAndSwap(1, 0, &topology_busy);
+}
+
+static bool rmi_topology_fetch(struct rmi_topology_cache *topology)
+{
+    bool found;
+    
+    rmi_topology_lock();
+    found = topology_cache.valid &&
+        !memcmp(topology_cache.key, topology->key, RMI_TOPOLOGY_KEY_LEN);
+    if (found)
+        memcpy(topology, &topology_cache, sizeof(topology_cache));
+    rmi_topology_unlock();
+    
+    return found;
+}
+
+static void rmi_topology_store(const struct rmi_topology_cache *topology)
+{
+    rmi_topology_lock();
+    memcpy(&topology_cache, topology, sizeof(topology_cache));
+    rmi_topology_unlock();
+}
+
+// Only drop the shared copy if it still describes this sensor
+static void rmi_topology_invalidate(const struct rmi_topology_cache *topology)
+{
+    rmi_topology_lock();
+    if (!memcmp(topology_cache.key, topology->key, RMI_TOPOLOGY_KEY_LEN))
+        topology_cache.valid = false;
+    rmi_topology_unlock();
+}
+
+void rmi_free_topology(rmi_driver_data *data)
+{
+    if (!data->topology)
+        return;
+    
+    IOFree(data->topology, sizeof(rmi_topology_cache));
+    data->topology = nullptr;
+}
+
+/*
+ * Not from rmi_driver
+ * Use the cached PDT if F01 answers with the same query registers it did
+ * last time, after checking the F01 entry and the last entry still match.
+ * Returns 1 on a hit, 0 on a miss, negative if there's no key to go by
+ */
+static int rmi_topology_lookup(RMIBus *dev, const struct pdt_entry *f01)
+{
+    struct rmi_topology_cache *topology = dev->data->topology;
+    struct pdt_entry last;
+    bool has_f01 = false;
+    int index;
+    
+    memset(topology, 0, sizeof(*topology));
+    
+    if (f01->function_number != 0x01)
+        return -ENODEV;
+    
+    if (dev->readBlock(f01->query_base_addr + f01->page_start, topology->key, RMI_TOPOLOGY_KEY_LEN) < 0)
+        return -EIO;
+    
+    if (!rmi_topology_fetch(topology))
+        return 0;
+    
+    for (index = 0; index < topology->entry_count; index++)
+        has_f01 |= rmi_pdt_entry_equal(&topology->entries[index], f01);
+    
+    if (!has_f01)
+        goto miss;
+    
+    index = topology->entry_count - 1;
+    if (rmi_read_pdt_entry(dev, &last, rmi_cached_pdt_address(topology, index)) ||
+        !rmi_pdt_entry_equal(&topology->entries[index], &last)) {
+        IOLog("Cached PDT doesn't match the sensor anymore\n");
+        rmi_topology_invalidate(topology);
+        goto miss;
+    }
+    
+    IOLogDebug("Using cached PDT with %d functions\n", topology->entry_count);
+    return 1;
+miss:
+    topology->valid = false;
+    topology->entry_count = 0;
+    return 0;
+}
+
+static int rmi_scan_cached_pdt(RMIBus *dev, void *ctx,
+                               int (*callback)(RMIBus* dev,
+                                               void *ctx, const struct pdt_entry *entry))
+{
+    struct rmi_topology_cache *topology = dev->data->topology;
+    int retval = RMI_SCAN_DONE;
+    
+    for (int i = 0; i < topology->entry_count; i++) {
+        retval = callback(dev, ctx, &topology->entries[i]);
+        if (retval != RMI_SCAN_CONTINUE)
+            break;
+    }
+    
+    return retval < 0 ? retval : 0;
+}
+
 int rmi_scan_pdt(RMIBus *dev, void *ctx,
                  int (*callback)(RMIBus* dev,
                                  void *ctx, const struct pdt_entry *entry))
@@ -149,6 +318,9 @@ int rmi_scan_pdt(RMIBus *dev, void *ctx,
     int empty_pages = 0;
     int retval = RMI_SCAN_DONE;
     
+    if (dev->data->pdt_cached)
+        return rmi_scan_cached_pdt(dev, ctx, callback);
+    
     for (page = 0; page <= RMI4_MAX_PAGE; page++) {
         retval = rmi_scan_pdt_page(dev, page, &empty_pages,
                                    ctx, callback);
@@ -164,6 +336,9 @@ int rmi_initial_reset(RMIBus *dev, void *ctx, const struct pdt_entry *pdt)
     int error;
     
     if (pdt->function_number == 0x01) {
+        if (ctx)
+            *reinterpret_cast<struct pdt_entry *>(ctx) = *pdt;
+        
         error = dev->reset();
         if (error < 0) {
             IOLogError("Unable to reset");
@@ -210,11 +385,18 @@ static int rmi_check_bootloader_mode(RMIBus *rmi_dev,
 static int rmi_count_irqs(RMIBus *rmi_dev,
                           void *ctx, const struct pdt_entry *pdt)
 {
+    struct rmi_topology_cache *topology = rmi_dev->data->topology;
     int *irq_count = reinterpret_cast<int *>(ctx);
     int ret;
     
     *irq_count += pdt->interrupt_source_count;
     
+    if (!rmi_dev->data->pdt_cached) {
+        if (topology->entry_count < RMI_TOPOLOGY_MAX_ENTRIES)
+            topology->entries[topology->entry_count] = *pdt;
+        topology->entry_count++;
+    }
+    
     ret = rmi_check_bootloader_mode(rmi_dev, pdt);
     if (ret < 0)
         return ret;
@@ -222,9 +404,69 @@ static int rmi_count_irqs(RMIBus *rmi_dev,
     return RMI_SCAN_CONTINUE;
 }
 
+struct rmi_validate_ctx {
+    int index;
+    bool changed;
+};
+
+static int rmi_validate_entry(RMIBus *rmi_dev,
+                              void *ctx, const struct pdt_entry *pdt)
+{
+    struct rmi_validate_ctx *validate = reinterpret_cast<rmi_validate_ctx *>(ctx);
+    const struct rmi_topology_cache *topology = rmi_dev->data->topology;
+    
+    /*
+     * entry_count keeps counting past the cache for PDTs that don't fit,
+     * those topologies are never marked valid and have nothing to compare
+     */
+    if (topology->valid) {
+        assert(topology->entry_count <= RMI_TOPOLOGY_MAX_ENTRIES);
+        
+        if (validate->index >= imin(topology->entry_count, RMI_TOPOLOGY_MAX_ENTRIES) ||
+            !rmi_pdt_entry_equal(&topology->entries[validate->index], pdt))
+            validate->changed = true;
+    }
+    
+    validate->index++;
+    return RMI_SCAN_CONTINUE;
+}
+
+/*
+ * Not from rmi_driver
+ * The sensor needs its PDT read to come back up after sleep, so compare it
+ * against the cached one while at it
+ */
+int rmi_validate_topology(RMIBus *rmi_dev)
+{
+    struct rmi_driver_data *data = rmi_dev->data;
+    struct rmi_validate_ctx validate = {0, false};
+    bool cached = data->pdt_cached;
+    int retval;
+    
+    data->pdt_cached = false;
+    retval = rmi_scan_pdt(rmi_dev, &validate, rmi_validate_entry);
+    data->pdt_cached = cached;
+    
+    if (retval < 0)
+        return retval;
+    
+    if (!data->topology->valid)
+        return 0;
+    
+    if (validate.changed || validate.index != data->topology->entry_count) {
+        IOLogError("PDT changed since the sensor was probed\n");
+        data->topology->valid = false;
+        rmi_topology_invalidate(data->topology);
+        return -ENODEV;
+    }
+    
+    return 0;
+}
+
 int rmi_probe_interrupts(RMIBus *rmi_dev, rmi_driver_data *data)
 {
     int irq_count = 0;
+    size_t size;
     int retval;
     
     /*
@@ -242,6 +484,20 @@ int rmi_probe_interrupts(RMIBus *rmi_dev, rmi_driver_data *data)
         return retval;
     }
     
+    // The layout moves around in bootloader mode, go look at the real one
+    if (data->pdt_cached && data->bootloader_mode) {
+        data->pdt_cached = false;
+        data->topology->valid = false;
+        data->topology->entry_count = 0;
+        rmi_topology_invalidate(data->topology);
+        irq_count = 0;
+        retval = rmi_scan_pdt(rmi_dev, &irq_count, rmi_count_irqs);
+        if (retval < 0) {
+            IOLogError("IRQ counting failed with code %d.\n", retval);
+            return retval;
+        }
+    }
+    
     if (data->bootloader_mode)
         IOLogDebug("Device in bootloader mode.\n");
     
@@ -249,10 +505,24 @@ int rmi_probe_interrupts(RMIBus *rmi_dev, rmi_driver_data *data)
     data->num_of_irq_regs = (data->irq_count + 7) / 8;
     IOLogDebug("IRQ Count: %d\n", data->irq_count);
     
-    data->irq_status        = 0;
-    data->fn_irq_bits       = 0;
-    data->current_irq_mask  = 0;
-    data->new_irq_mask      = 0;
+    rmi_free_irq_memory(data);
+    
+    size = BITS_TO_LONGS(data->irq_count) * sizeof(unsigned long);
+    data->irq_memory = reinterpret_cast<unsigned long *>(IOMalloc(size * RMI_IRQ_BITMAPS));
+    if (!data->irq_memory) {
+        IOLogError("Failed to allocate memory for irq masks.\n");
+        return -ENOMEM;
+    }
+    
+    memset(data->irq_memory, 0, size * RMI_IRQ_BITMAPS);
+    data->irq_memory_size = size * RMI_IRQ_BITMAPS;
+    
+    data->irq_status        = data->irq_memory + size * 0 / sizeof(unsigned long);
+    data->fn_irq_bits       = data->irq_memory + size * 1 / sizeof(unsigned long);
+    data->current_irq_mask  = data->irq_memory + size * 2 / sizeof(unsigned long);
+    data->new_irq_mask      = data->irq_memory + size * 3 / sizeof(unsigned long);
+    data->fn_mask           = data->irq_memory + size * 4 / sizeof(unsigned long);
+    data->attn_status       = data->irq_memory + size * 5 / sizeof(unsigned long);
     
     return retval;
 }
@@ -334,74 +604,88 @@ static int rmi_driver_process_config_requests(RMIBus *rmi_dev)
  * This isn't from rmi_driver
  * Just getting the mask from all the started functions
  */
-static unsigned long getMask(RMIBus *rmiBus)
+static void getMask(RMIBus *rmiBus, unsigned long *mask)
 {
     RMIFunction *func;
-    unsigned long mask = 0;
+    
+    memset(mask, 0, rmiBus->data->irq_memory_size / RMI_IRQ_BITMAPS);
     
     OSIterator* iter = rmiBus->getClientIterator();
-    while ((func = OSDynamicCast(RMIFunction, iter->getNextObject()))) {
-        unsigned long funcMask = func->getIRQ();
-        mask |= funcMask;
-    }
+    while ((func = OSDynamicCast(RMIFunction, iter->getNextObject())))
+        func->getIRQ(mask);
     
     OSSafeReleaseNULL(iter);
-    
-    return mask;
 }
 
-int rmi_driver_clear_irq_bits(RMIBus *rmi_dev)
+/*
+ * Not from rmi_driver either
+ * Applies new_irq_mask to the device, only keeping it if that worked
+ */
+static int rmi_write_irq_mask(RMIBus *rmi_dev)
 {
     rmi_driver_data *data = rmi_dev->data;
+    int error;
     
-    unsigned long mask = getMask(rmi_dev);
+    error = rmi_dev->blockWrite(data->f01_container->fd.control_base_addr + 1,
+                                reinterpret_cast<u8*>(data->new_irq_mask), data->num_of_irq_regs);
+    if (error < 0)
+        return error;
     
+    memcpy(data->current_irq_mask, data->new_irq_mask,
+           BITS_TO_LONGS(data->irq_count) * sizeof(unsigned long));
+    return 0;
+}
+
+int rmi_driver_clear_irq_bits(RMIBus *rmi_dev)
+{
+    rmi_driver_data *data = rmi_dev->data;
+    int words = BITS_TO_LONGS(data->irq_count);
     int error = 0;
-    IOLockLock(data->irq_mutex);
-    data->fn_irq_bits &= ~mask;
-    data->new_irq_mask = data->current_irq_mask & ~mask;
     
-    error = rmi_dev->blockWrite(data->f01_container->fd.control_base_addr + 1,
-                                reinterpret_cast<u8*>(&data->new_irq_mask), data->num_of_irq_regs);
+    IOLockLock(data->irq_mutex);
+    getMask(rmi_dev, data->fn_mask);
     
-    if (error < 0) {
-        IOLogError("%s: Filaed to change enabled interrupts!", __func__);
-        goto error_unlock;
+    for (int i = 0; i < words; i++) {
+        data->fn_irq_bits[i] &= ~data->fn_mask[i];
+        data->new_irq_mask[i] = data->current_irq_mask[i] & ~data->fn_mask[i];
     }
     
-    data->current_irq_mask = data->new_irq_mask;
+    error = rmi_write_irq_mask(rmi_dev);
+    if (error < 0)
+        IOLogError("%s: Filaed to change enabled interrupts!", __func__);
     
-error_unlock:
     IOLockUnlock(data->irq_mutex);
     return error;
 }
 
 int rmi_driver_set_irq_bits(RMIBus *rmi_dev)
 {
-    int error = 0;
-    unsigned long mask = getMask(rmi_dev);
     rmi_driver_data *data = rmi_dev->data;
+    int words = BITS_TO_LONGS(data->irq_count);
+    int error = 0;
     
     IOLockLock(data->irq_mutex);
+    getMask(rmi_dev, data->fn_mask);
+    
     // Dummy read in order to clear irqs
     error = rmi_dev->readBlock(data->f01_container->fd.data_base_addr + 1,
-                               (u8 *)&data->irq_status, data->num_of_irq_regs);
+                               reinterpret_cast<u8 *>(data->irq_status), data->num_of_irq_regs);
     
     if (error < 0) {
         IOLogError("%s: Failed to read interrupt status!", __func__);
     }
     
-    data->new_irq_mask = mask | data->current_irq_mask;
+    for (int i = 0; i < words; i++)
+        data->new_irq_mask[i] = data->fn_mask[i] | data->current_irq_mask[i];
     
-    error = rmi_dev->blockWrite(data->f01_container->fd.control_base_addr + 1,
-                                reinterpret_cast<u8*>(&data->new_irq_mask), data->num_of_irq_regs);
+    error = rmi_write_irq_mask(rmi_dev);
     if (error < 0) {
         IOLogError("%s: Failed to change enabled intterupts!", __func__);
         goto error_unlock;
     }
     
-    data->current_irq_mask = data->new_irq_mask;
-    data->fn_irq_bits = mask | data->fn_irq_bits;
+    for (int i = 0; i < words; i++)
+        data->fn_irq_bits[i] |= data->fn_mask[i];
     
 error_unlock:
     IOLockUnlock(data->irq_mutex);
@@ -442,7 +726,7 @@ int rmi_init_functions(RMIBus *rmi_dev, rmi_driver_data *data)
     
     retval = rmi_dev->readBlock(
                             data->f01_container->fd.control_base_addr + 1,
-                            reinterpret_cast<u8 *>(&data->current_irq_mask), data->num_of_irq_regs);
+                            reinterpret_cast<u8 *>(data->current_irq_mask), data->num_of_irq_regs);
     
     if (retval < 0) {
         IOLogError("%s: Failed to read current IRQ mask.\n", __func__);
@@ -459,7 +743,15 @@ void rmi_free_function_list(RMIBus *rmi_dev)
     IOLogDebug("Freeing function list\n");
     
     if (data->f01_container)
-        IOFree(data->f01_container, sizeof(rmi_function));
+        IOFree(data->f01_container, data->f01_container->size);
     data->f01_container = NULL;
 }
 
+void rmi_free_irq_memory(rmi_driver_data *data)
+{
+    if (data->irq_memory)
+        IOFree(data->irq_memory, data->irq_memory_size);
+    data->irq_memory = NULL;
+    data->irq_memory_size = 0;
+}
+
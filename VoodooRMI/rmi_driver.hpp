@@ -31,6 +31,9 @@
 #define RMI_SCAN_CONTINUE    0
 #define RMI_SCAN_DONE        1
 
+/* irq_status, fn_irq_bits, current_irq_mask, new_irq_mask, fn_mask and attn_status */
+#define RMI_IRQ_BITMAPS      6
+
 struct pdt_entry {
     u16 page_start;
     u8 query_base_addr;
@@ -42,14 +45,34 @@ struct pdt_entry {
     u8 function_number;
 };
 
+#define RMI_TOPOLOGY_MAX_ENTRIES 16
+/* F01 query 0 through 20, manufacturer, product info, date and product ID */
+#define RMI_TOPOLOGY_KEY_LEN 21
+
+/*
+ * Not from rmi_driver
+ * Each sensor keeps the PDT it was probed with. The one of the last sensor
+ * probed is also copied into a shared cache, kept for as long as the kext
+ * is loaded so the same firmware doesn't have its PDT walked again
+ */
+struct rmi_topology_cache {
+    bool valid;
+    u8 key[RMI_TOPOLOGY_KEY_LEN];
+    int entry_count;
+    struct pdt_entry entries[RMI_TOPOLOGY_MAX_ENTRIES];
+};
+
 int rmi_driver_probe(RMIBus *dev);
 int rmi_initial_reset(RMIBus *dev, void *ctx, const struct pdt_entry *pdt);
 int rmi_scan_pdt(RMIBus *dev, void *ctx,
                 int (*callback)(RMIBus* dev,
                                 void *ctx, const struct pdt_entry *entry));
 int rmi_probe_interrupts(RMIBus *rmi_dev, rmi_driver_data *data);
+int rmi_validate_topology(RMIBus *rmi_dev);
 int rmi_init_functions(RMIBus *rmi_dev, rmi_driver_data *data);
 void rmi_free_function_list(RMIBus *rmi_dev);
+void rmi_free_irq_memory(rmi_driver_data *data);
+void rmi_free_topology(rmi_driver_data *data);
 int rmi_enable_sensor(RMIBus *rmi_dev);
 int rmi_driver_set_irq_bits(RMIBus *rmi_dev);
 int rmi_driver_clear_irq_bits(RMIBus *rmi_dev);